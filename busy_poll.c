@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <time.h>
+#include "busy_poll.h"
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// let the sibling hyperthread run and save power while spinning
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void busy_poll_init(struct BusyPoll* bp) {
+    const char* us = getenv(BUSY_POLL_ENV);
+    bp->max_ns = us != NULL ? atoll(us) * 1000 : 0;
+    if (bp->max_ns < 0) bp->max_ns = 0;
+    bp->budget_ns = bp->max_ns;
+    bp->blocked_at = 0;
+}
+
+// spin until one of the descriptors is ready or the budget runs out, 1 if ready and 0 if the caller must block
+// a spin that found work doubles the budget, one that ran dry halves it, so an idle process stops spinning
+int busy_poll(struct BusyPoll* bp, struct pollfd* fds, int nfds) {
+    if (bp->budget_ns == 0) {
+        if (bp->max_ns > 0) bp->blocked_at = now_ns();
+        return 0;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t now = start;
+    while (now - start < (uint64_t)bp->budget_ns) {
+        if (poll(fds, nfds, 0) > 0) {
+            bp->budget_ns = bp->budget_ns * 2 < bp->max_ns ? bp->budget_ns * 2 : bp->max_ns;
+            return 1;
+        }
+        cpu_relax();
+        now = now_ns();
+    }
+
+    bp->budget_ns /= 2;
+    if (bp->budget_ns < BUSY_POLL_MIN_NS) bp->budget_ns = 0;
+    bp->blocked_at = now;
+    return 0;
+}
+
+// after a blocking wait: if the work came within the spin limit, spinning would have caught it, so start again
+void busy_poll_woke(struct BusyPoll* bp) {
+    if (bp->max_ns == 0) return;
+    if (now_ns() - bp->blocked_at < (uint64_t)bp->max_ns) bp->budget_ns = bp->max_ns;
+}
@@ -0,0 +1,23 @@
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include <poll.h>
+#include <stdint.h>
+
+// opt-in low latency receive: spin on a non-blocking readiness check before falling back to a blocking wait
+//   if (!busy_poll(&bp, fds, n)) { blocking wait; busy_poll_woke(&bp); }
+
+#define BUSY_POLL_ENV "DS_BUSY_POLL_US" // longest spin in microseconds, busy polling is off if unset or 0
+#define BUSY_POLL_MIN_NS 1000 // a budget shrunk below this stops spinning until traffic picks up again
+
+struct BusyPoll {
+    int64_t max_ns; // 0 when disabled
+    int64_t budget_ns; // how long the next wait spins, adapts to how often spinning paid off
+    uint64_t blocked_at; // when the last spin gave up
+};
+
+void busy_poll_init(struct BusyPoll* bp);
+int busy_poll(struct BusyPoll* bp, struct pollfd* fds, int nfds);
+void busy_poll_woke(struct BusyPoll* bp);
+
+#endif
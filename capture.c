@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "capture.h"
+#include "ring.h"
+
+static struct RecordRing capture_ring;
+static int capturing = 0;
+
+int capture_open(const char* path) {
+    struct CaptureHeader header = { CAPTURE_MAGIC, CAPTURE_VERSION, sizeof(struct CaptureRecord), 0 };
+    if (ring_open(&capture_ring, path, sizeof(struct CaptureRecord), CAPTURE_RING_CAP,
+                  &header, sizeof(header), offsetof(struct CaptureHeader, dropped)) < 0) {
+        return -1;
+    }
+    capturing = 1;
+    return 0;
+}
+
+// record an incoming packet, a no-op unless capturing was enabled
+void capture_packet(const struct Packet* pck) {
+    if (!capturing) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct CaptureRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    rec.client_id = pck->client_id;
+    rec.priority = pck->priority;
+    rec.value = pck->value;
+    ring_push(&capture_ring, &rec);
+}
+
+// async-signal-safe flush for the termination handler
+void capture_drain() {
+    if (capturing) ring_drain(&capture_ring);
+}
+
+void capture_close() {
+    if (!capturing) return;
+    ring_close(&capture_ring);
+    capturing = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+#define CAPTURE_ENV "LB_CAPTURE_FILE" // set to a path to make the load balancer record its requests
+#define CAPTURE_MAGIC 0x50414354u // "TCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RING_CAP 65536 // records buffered between the load balancer and the writer thread
+
+// the file starts with a header followed by fixed size records, so it can be mmapped and indexed directly
+struct CaptureHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t dropped; // requests that didn't make it into the file, kept up to date by the recorder
+};
+
+struct CaptureRecord {
+    uint64_t ts_ns; // arrival time, CLOCK_MONOTONIC
+    int32_t client_id;
+    int32_t priority;
+    float value;
+    uint32_t reserved;
+};
+
+int capture_open(const char* path);
+void capture_packet(const struct Packet* pck);
+void capture_drain();
+void capture_close();
+
+#endif
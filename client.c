@@ -4,25 +4,42 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include "protocol.h"
 
 #define CLIENT_SOCKET_PATH "/tmp/cl-lb"   // the socket path for the communication with the server
-
-struct Packet {
-    int client_id;
-    float value;
-};
+#define USAGE "Usage: %s [-t] <client_id> [priority: 0 high, 1 normal, 2 low]\n"
 
 int main(int argc, char *argv[]) {
+    // -t asks for the request to be traced, the load balancer gives it a trace id
+    // it is only taken as the first argument, so a negative client id isn't mistaken for an option
+    int traced = argc > 1 && strcmp(argv[1], "-t") == 0;
+    int first = traced ? 2 : 1; // the client id
+
     // check if the client script was called in the right way
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <client_id>\n", argv[0]);
+    int args = argc - first;
+    if (args != 1 && args != 2) {
+        fprintf(stderr, USAGE, argv[0]);
         return 1;
     }
 
     // obtain the client id
-    int client_id = atoi(argv[1]);
+    int client_id = atoi(argv[first]);
     printf("Client id: %d\n", client_id);
 
+    // obtain the priority, untagged requests are classified by the load balancer
+    int priority = -1;
+    if (args == 2) {
+        char* prio_end;
+        long prio = strtol(argv[first + 1], &prio_end, 10);
+        // a typo must not end up in the high class
+        if (prio_end == argv[first + 1] || *prio_end != '\0' || prio < 0 || prio >= PRIO_COUNT) {
+            fprintf(stderr, "Invalid priority\n");
+            fprintf(stderr, USAGE, argv[0]);
+            return 1;
+        }
+        priority = (int)prio;
+    }
+
     // prepare the values
     char input[100]; // char array to read the input to
     float value; // converted value of the user input
@@ -48,7 +65,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    struct Packet pckt = { client_id, value };
+    struct Packet pckt = { client_id, value, priority };
+    if (traced) pckt.flags |= PACKET_SAMPLED;
 
     int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
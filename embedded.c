@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "protocol.h"
+#include "sched.h"
+#include "route.h"
+#include "queue.h"
+#include "transport.h"
+#include "topology.h"
+#include "prof.h"
+
+// the whole tree in one process: watchdog, load balancer, reverse proxies and servers run as threads
+// and pass requests through lock-free queues instead of sockets, the watchdog collects the informs of all
+// threads through one multi-producer queue
+// usage: embedded [-q] [-b requests] [-c in_flight]
+//   -q  no per-request logging
+//   -b  inject the given amount of requests, print the end to end latency percentiles and exit
+//   -c  requests the benchmark keeps in flight, 1 (the default) measures the bare pipeline latency
+
+#define WD_LOG_STR "[WATCHDOG]: %s\n"
+#define INFORM_STR "%s %d informed their tid %d\n"
+#define INFORM_CPU_STR "%s %d informed their tid %d, pinned to cpu %d\n"
+#define LB_LOG_STR "[LOAD BALANCER]: %s\n"
+#define RP_LOG_STR "[REVERSE PROXY %d]: %s\n"
+#define SV_LOG_STR "[SERVER %d]: %s\n"
+#define CLIENT_SOCKET_PATH "/tmp/cl-lb"   // the socket path for the communication with the client
+#define HOP_QUEUE_CAP 1024 // requests in flight between two threads
+#define UP_QUEUE_CAP 1024 // messages in flight from a reverse proxy to the load balancer
+#define INJECT_BACKLOG 256 // queued requests above which the load balancer stops taking benchmark requests
+#define SPIN_ROUNDS 1000 // idle rounds spent spinning before yielding the cpu
+#define YIELD_ROUNDS 1100 // idle rounds after which the thread sleeps between polls
+#define IDLE_SLEEP_NS 50000 // 50 us
+
+struct RpThread {
+    int idx;
+    pthread_t tid;
+    struct SpscQueue in; // requests from the load balancer
+    struct SpscQueue up; // load reports and handed back requests for the load balancer
+    struct ProxyQueue proxy; // the same queue and load reports as a reverse proxy daemon
+};
+
+struct SvThread {
+    int idx;
+    pthread_t tid;
+    struct SpscQueue in; // requests from its reverse proxy
+};
+
+atomic_int running = 1;
+int quiet = 0;
+int rp_num; // reverse proxies, DS_RP_AMOUNT
+int sv_num; // servers per reverse proxy, DS_SV_AMOUNT
+struct RpThread rps[MAX_RP];
+struct SvThread svs[MAX_RP * MAX_SV];
+struct MpscQueue wd_queue; // process informs for the watchdog
+struct SpscQueue inject; // benchmark requests for the load balancer
+
+// benchmark bookkeeping, indexed by trace id
+long bench_total = 0;
+long bench_window = 1; // requests in flight at once
+uint64_t* bench_sent;
+uint64_t* bench_latency;
+atomic_long bench_done = 0;
+atomic_long bench_dropped = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// called each time a thread's poll found nothing to do: spin first, then yield, then nap
+static void idle(int* rounds) {
+    (*rounds)++;
+    if (*rounds < SPIN_ROUNDS) {
+        cpu_relax();
+    } else if (*rounds < YIELD_ROUNDS) {
+        sched_yield();
+    } else {
+        struct timespec nap = {0, IDLE_SLEEP_NS};
+        nanosleep(&nap, NULL);
+    }
+}
+
+// a full queue means the consumer is behind, wait for it unless we are shutting down
+static int push_wait(struct SpscQueue* q, const void* elem) {
+    int rounds = 0;
+    while (spsc_push(q, elem) < 0) {
+        if (!atomic_load(&running)) return -1;
+        idle(&rounds);
+    }
+    return 0;
+}
+
+// pin the calling thread to its place and tell the watchdog
+static void inform(enum ProcessType type, int idx) {
+    struct ProcessInform inf = { type, idx, gettid(), placement_pin(type, idx) };
+    int rounds = 0;
+    while (mpsc_push(&wd_queue, &inf) < 0 && atomic_load(&running)) idle(&rounds);
+}
+
+const char* process_to_string(enum ProcessType type) {
+    switch (type)
+    {
+        case LOAD_BALANCER:
+            return "Load Balancer";
+        case REVERSE_PROXY:
+            return "Reverse Proxy";
+        case SERVER:
+            return "Server";
+        default:
+            return "Unknown process";
+    }
+}
+
+void* watchdog_main(void* arg) {
+    PROF_THREAD("watchdog");
+    printf(WD_LOG_STR, "Started");
+    int rounds = 0;
+    while (atomic_load(&running)) {
+        struct ProcessInform inf;
+        if (mpsc_pop(&wd_queue, &inf) < 0) {
+            idle(&rounds);
+            continue;
+        }
+        rounds = 0;
+        if (inf.cpu >= 0) {
+            printf(INFORM_CPU_STR, process_to_string(inf.type), inf.p_idx, inf.p_id, inf.cpu);
+        } else {
+            printf(INFORM_STR, process_to_string(inf.type), inf.p_idx, inf.p_id);
+        }
+    }
+    return NULL;
+}
+
+void* server_main(void* arg) {
+    struct SvThread* sv = arg;
+    PROF_THREAD("server");
+    printf(SV_LOG_STR, sv->idx, "Started");
+    inform(SERVER, sv->idx);
+
+    int rounds = 0;
+    while (atomic_load(&running)) {
+        struct Packet pck;
+        if (spsc_pop(&sv->in, &pck) < 0) {
+            idle(&rounds);
+            continue;
+        }
+        rounds = 0;
+
+        double root = sqrt(pck.value);
+
+        if (bench_total > 0) {
+            bench_latency[pck.trace_id] = now_ns() - bench_sent[pck.trace_id];
+            atomic_fetch_add(&bench_done, 1);
+        }
+        if (!quiet) {
+            char log_buf[128];
+            snprintf(log_buf, sizeof(log_buf), "Processing client %d, value: %f", pck.client_id, root);
+            printf(SV_LOG_STR, sv->idx, log_buf);
+        }
+    }
+    return NULL;
+}
+
+// hand a request to server idx of the reverse proxy, -1 while its queue is full
+static int rp_to_server(void* ctx, int sv_idx, const struct Packet* pck) {
+    struct RpThread* rp = ctx;
+    struct SvThread* sv = &svs[rp->idx * sv_num + sv_idx];
+    if (spsc_push(&sv->in, pck) < 0) return -1;
+
+    if (!quiet) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Forwarded client %d to server %d", pck->client_id, sv_idx);
+        printf(RP_LOG_STR, rp->idx, msg);
+    }
+    return 0;
+}
+
+static int rp_up(void* ctx, const struct UpMsg* msg) {
+    struct RpThread* rp = ctx;
+    return spsc_push(&rp->up, msg);
+}
+
+void* reverse_proxy_main(void* arg) {
+    struct RpThread* rp = arg;
+    PROF_THREAD("reverse_proxy");
+    printf(RP_LOG_STR, rp->idx, "Started");
+    inform(REVERSE_PROXY, rp->idx);
+
+    int rounds = 0;
+    while (atomic_load(&running)) {
+        int work = 0;
+        struct Packet pck;
+        while (spsc_pop(&rp->in, &pck) == 0) {
+            work++;
+            if (route_proxy_enqueue(&rp->proxy, &pck) < 0) {
+                char err_buf[128];
+                snprintf(err_buf, sizeof(err_buf), "Queue of class %d is full, dropping request", packet_class(&pck));
+                printf(RP_LOG_STR, rp->idx, err_buf);
+                if (bench_total > 0) atomic_fetch_add(&bench_dropped, 1);
+            }
+        }
+        work += route_dispatch(&rp->proxy, sv_num, rp_to_server, rp);
+        route_rebalance(&rp->proxy, rp->idx, rp_up, rp);
+
+        if (work == 0) {
+            idle(&rounds);
+        } else {
+            rounds = 0;
+        }
+    }
+    return NULL;
+}
+
+// load balancer state, only touched by its thread
+struct RpLink rp_links[MAX_RP]; // the same queues and windows as the load balancer daemon
+struct RateLimiter limiter;
+
+static int lb_pending() {
+    int pending = 0;
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) pending += rp_links[rp_idx].queue.pending;
+    return pending;
+}
+
+static void lb_enqueue(int rp_idx, const struct Packet* pck) {
+    if (sched_enqueue(&rp_links[rp_idx].queue, pck) < 0) {
+        char err_buf[128];
+        snprintf(err_buf, sizeof(err_buf), "Queue of class %d for RP %d is full, dropping request",
+                 packet_class(pck), rp_idx);
+        printf(LB_LOG_STR, err_buf);
+        if (bench_total > 0) atomic_fetch_add(&bench_dropped, 1);
+    }
+}
+
+static void lb_admit(const struct Packet* pck) {
+    if (!rate_allow(&limiter, pck->client_id)) {
+        if (!quiet) {
+            char msg[96];
+            snprintf(msg, sizeof(msg), "Client %d is over its rate limit, dropping request", pck->client_id);
+            printf(LB_LOG_STR, msg);
+        }
+        if (bench_total > 0) atomic_fetch_add(&bench_dropped, 1);
+        return;
+    }
+
+    int loads[MAX_RP];
+    route_loads(rp_links, rp_num, loads);
+    lb_enqueue(route_choose(pck->client_id, loads, rp_num), pck);
+}
+
+// hand a request to reverse proxy idx, -1 while its queue is full
+static int lb_to_rp(void* ctx, int rp_idx, const struct Packet* pck) {
+    if (spsc_push(&rps[rp_idx].in, pck) < 0) return -1;
+
+    if (!quiet) {
+        char bf[128];
+        snprintf(bf, sizeof(bf), "Request from Client %d. Forwarding to Reverse Proxy %d", pck->client_id, rp_idx);
+        printf(LB_LOG_STR, bf);
+    }
+    return 0;
+}
+
+// move queued requests to the reverse proxies in priority order until their windows or queues are full
+static int lb_flush() {
+    int moved = 0;
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        moved += route_forward(&rp_links[rp_idx], rp_idx, lb_to_rp, NULL);
+    }
+    return moved;
+}
+
+// handle the messages the reverse proxies sent up
+static int lb_read_up() {
+    int handled = 0;
+    for (int from_idx = 0; from_idx < rp_num; from_idx++) {
+        struct UpMsg msg;
+        while (spsc_pop(&rps[from_idx].up, &msg) == 0) {
+            handled++;
+            if (msg.kind == UP_LOAD) {
+                route_report(&rp_links[from_idx], &msg.load);
+            } else if (msg.kind == UP_PUSHBACK && route_hand_back(rp_links, rp_num, from_idx, &msg.pck) < 0) {
+                char err_buf[128];
+                snprintf(err_buf, sizeof(err_buf), "Queue of class %d is full, dropping request moved from RP %d",
+                         packet_class(&msg.pck), from_idx);
+                printf(LB_LOG_STR, err_buf);
+                if (bench_total > 0) atomic_fetch_add(&bench_dropped, 1);
+            }
+        }
+    }
+    return handled;
+}
+
+// clients connect on the usual socket, accepts are polled so the thread never blocks
+static int lb_listen() {
+    unlink(CLIENT_SOCKET_PATH);
+
+    int lb_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lb_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CLIENT_SOCKET_PATH, sizeof(addr.sun_path)-1);
+
+    if (bind(lb_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lb_fd, 5) < 0) {
+        perror("bind");
+        close(lb_fd);
+        return -1;
+    }
+    return lb_fd;
+}
+
+static int lb_accept(int lb_fd) {
+    int client_fd = accept(lb_fd, NULL, NULL);
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+        return 0;
+    }
+
+    struct Packet pck;
+    ssize_t bytes_read = read_full(client_fd, &pck, sizeof(pck));
+    close(client_fd);
+    if (bytes_read != sizeof(pck)) return 0;
+
+    pck.flags = 0;
+    pck.trace_id = 0;
+    lb_admit(&pck);
+    return 1;
+}
+
+void* load_balancer_main(void* arg) {
+    PROF_THREAD("load_balancer");
+    int lb_fd = bench_total > 0 ? -1 : lb_listen();
+    printf(LB_LOG_STR, "Started");
+    inform(LOAD_BALANCER, 0);
+
+    rate_init(&limiter);
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        route_link_init(&rp_links[rp_idx]);
+        route_attach(&rp_links[rp_idx]);
+    }
+
+    int rounds = 0;
+    while (atomic_load(&running)) {
+        int work = 0;
+        if (lb_fd != -1) work += lb_accept(lb_fd);
+
+        // benchmark requests are only taken while there is room, like clients blocked on a full socket
+        struct Packet pck;
+        while (lb_pending() < INJECT_BACKLOG && spsc_pop(&inject, &pck) == 0) {
+            lb_admit(&pck);
+            work++;
+        }
+        work += lb_read_up();
+        work += lb_flush();
+
+        if (work == 0) {
+            idle(&rounds);
+        } else {
+            rounds = 0;
+        }
+    }
+
+    if (lb_fd != -1) {
+        close(lb_fd);
+        unlink(CLIENT_SOCKET_PATH);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// feed the requests in, keeping the given amount in flight, and report how long each one took to reach a server
+static void run_bench() {
+    uint64_t start = now_ns();
+    int rounds = 0;
+    for (long i = 0; i < bench_total; i++) {
+        while (i - atomic_load(&bench_done) - atomic_load(&bench_dropped) >= bench_window) idle(&rounds);
+        rounds = 0;
+
+        // every request gets its own client so the rate limiter stays out of the measurement
+        struct Packet pck = { (int)i, (float)i, -1, 0, (uint64_t)i };
+        bench_sent[i] = now_ns();
+        if (push_wait(&inject, &pck) < 0) return;
+    }
+
+    while (atomic_load(&bench_done) + atomic_load(&bench_dropped) < bench_total) idle(&rounds);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // dropped requests kept a zero latency, leave them out
+    long done = atomic_load(&bench_done);
+    long dropped = atomic_load(&bench_dropped);
+    qsort(bench_latency, bench_total, sizeof(uint64_t), cmp_u64);
+    uint64_t* lat = bench_latency + dropped;
+    printf("Requests: %ld served, %ld dropped in %.3f s (%.0f req/s)\n", done, dropped, elapsed, done / elapsed);
+    if (done == 0) return;
+    printf("Latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           lat[done / 2] / 1e3, lat[done * 9 / 10] / 1e3, lat[done * 99 / 100] / 1e3, lat[done - 1] / 1e3);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "qb:c:")) != -1) {
+        switch (opt)
+        {
+        case 'q':
+            quiet = 1;
+            break;
+        case 'b':
+            bench_total = atol(optarg);
+            break;
+        case 'c':
+            bench_window = atol(optarg) > 0 ? atol(optarg) : 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-b requests] [-c in_flight]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_total > 0) {
+        bench_sent = calloc(bench_total, sizeof(uint64_t));
+        bench_latency = calloc(bench_total, sizeof(uint64_t));
+        if (bench_sent == NULL || bench_latency == NULL) {
+            perror("calloc");
+            return 1;
+        }
+    }
+
+    PROF_INIT("embedded");
+
+    // settle the cpus before any thread pins itself, the amounts come from the environment like in the tree
+    char summary[512];
+    topology_export(summary, sizeof(summary));
+    rp_num = rp_amount();
+    sv_num = sv_amount();
+    printf("%d reverse proxies with %d servers each, %s\n", rp_num, sv_num, summary);
+
+    if (mpsc_init(&wd_queue, sizeof(struct ProcessInform), 64) < 0 ||
+        spsc_init(&inject, sizeof(struct Packet), HOP_QUEUE_CAP) < 0) {
+        perror("queue init");
+        return 1;
+    }
+
+    // the threads inherit the blocked signals, only main waits for them
+    sigset_t stop_sigs;
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGINT);
+    sigaddset(&stop_sigs, SIGTERM);
+    sigaddset(&stop_sigs, SIGTSTP);
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+
+    pthread_t wd_tid, lb_tid;
+    pthread_create(&wd_tid, NULL, watchdog_main, NULL);
+
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        struct RpThread* rp = &rps[rp_idx];
+        rp->idx = rp_idx;
+        route_proxy_init(&rp->proxy);
+        if (spsc_init(&rp->in, sizeof(struct Packet), HOP_QUEUE_CAP) < 0 ||
+            spsc_init(&rp->up, sizeof(struct UpMsg), UP_QUEUE_CAP) < 0) {
+            perror("queue init");
+            return 1;
+        }
+
+        for (int sv_id = 0; sv_id < sv_num; sv_id++) {
+            struct SvThread* sv = &svs[rp_idx * sv_num + sv_id];
+            sv->idx = rp_idx * sv_num + sv_id;
+            if (spsc_init(&sv->in, sizeof(struct Packet), HOP_QUEUE_CAP) < 0) {
+                perror("queue init");
+                return 1;
+            }
+            pthread_create(&sv->tid, NULL, server_main, sv);
+        }
+        pthread_create(&rp->tid, NULL, reverse_proxy_main, rp);
+    }
+    pthread_create(&lb_tid, NULL, load_balancer_main, NULL);
+
+    if (bench_total > 0) {
+        run_bench();
+    } else {
+        int sig;
+        sigwait(&stop_sigs, &sig);
+        printf(WD_LOG_STR, "Received stop signal. Terminating");
+    }
+
+    atomic_store(&running, 0);
+    pthread_join(lb_tid, NULL);
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        pthread_join(rps[rp_idx].tid, NULL);
+    }
+    for (int sv_idx = 0; sv_idx < rp_num * sv_num; sv_idx++) {
+        pthread_join(svs[sv_idx].tid, NULL);
+    }
+    pthread_join(wd_tid, NULL);
+    return 0;
+}
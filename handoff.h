@@ -0,0 +1,54 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "protocol.h"
+#include "topology.h"
+
+// zero-downtime restart of a load balancer, coordinated by the watchdog:
+//   watchdog: starts the new binary with one end of a socketpair and sends HANDOFF_CMD with the other end
+//             down the old load balancer's socket
+//   old: offers its traffic with a HandoffOffer and keeps serving from its loop while it waits
+//   new: answers HANDOFF_READY once it can take the offer, then waits for the commit without touching anything
+//   old: on HANDOFF_READY stops accepting and reading, writes what the reverse proxies take within
+//        HANDOFF_DRAIN_MS, then commits with a HandoffState carrying the client and reverse proxy sockets,
+//        followed by the requests still queued, and exits
+//   new: takes everything over once the whole commit has arrived, exits if it doesn't
+// until the commit only the old one uses the sockets, so it can give up at any point before and keep serving
+
+#define HANDOFF_CMD 'H'
+#define HANDOFF_READY 'R'
+#define HANDOFF_READY_TIMEOUT_MS 5000
+#define HANDOFF_DRAIN_MS 200
+#define HANDOFF_MAX_FDS (2 + MAX_RP) // client socket, tcp listening socket, reverse proxies
+#define HANDOFF_OUT_BYTES 1024 // room for the unwritten batch of a reverse proxy
+
+struct HandoffOffer {
+    int rp_num; // the successor has to run as many reverse proxies
+};
+
+struct HandoffState {
+    int rp_num;
+    int has_rp_listen; // the tcp listening socket follows the client one
+    int rp_connected[MAX_RP]; // reverse proxies whose socket comes along, in index order
+    pid_t rp_p_ids[MAX_RP];
+    int rp_reported[MAX_RP];
+    int rp_credits[MAX_RP];
+    uint32_t rp_out_len[MAX_RP]; // bytes of a batch not yet written to each reverse proxy
+    char rp_out[MAX_RP][HANDOFF_OUT_BYTES];
+    uint32_t rp_in_len[MAX_RP]; // start of a message already read from each reverse proxy
+    char rp_in[MAX_RP][sizeof(struct UpMsg)];
+    uint64_t trace_seq;
+    int queued; // HandoffRequests following the state
+};
+
+struct HandoffRequest {
+    int rp_idx;
+    struct Packet pck;
+};
+
+int send_with_fds(int sock, const void* buf, size_t len, const int* fds, int nfds);
+ssize_t recv_with_fds(int sock, void* buf, size_t len, int* fds, int* nfds, int max_fds);
+
+#endif
@@ -7,45 +7,64 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include "protocol.h"
+#include "sched.h"
+#include "capture.h"
+#include "pool.h"
+#include "span.h"
+#include "transport.h"
+#include "prof.h"
+#include "route.h"
+#include "topology.h"
+#include "handoff.h"
+#include "ring.h"
 
 #define LB_LOG_STR "[LOAD BALANCER]: %s\n"
 #define CLIENT_SOCKET_PATH "/tmp/cl-lb"   // the socket path for the communication with the client
-//#define MAX_RP 10
-#define INIT_RP 2
-
-enum ProcessType { LOAD_BALANCER, REVERSE_PROXY, SERVER };
-
-struct ProcessInform {
-    enum ProcessType type;
-    int p_idx;
-    pid_t p_id;
-};
-
-struct Packet {
-    int client_id;
-    float value;
-};
+#define RP_BATCH_BYTES 1024 // size of the outbound buffer of each reverse proxy
+#define RP_READ_BYTES 1024 // size of the inbound buffer from each reverse proxy
 
 int lb_id; // id of the loadbalancer
 int wd_fd; // socket for watchdog
-int rp_sockets[INIT_RP] = {-1}; // socket for each reverse proxy
-pid_t rp_p_ids[INIT_RP] = {0}; // an array for the process ids for each reverse proxy
+int wd_commands = 1; // whether the watchdog's socket is still watched for commands
+int lb_fd = -1; // listening socket for the clients
+int rp_num; // reverse proxies of this load balancer, DS_RP_AMOUNT
+int rp_listen_fd = -1; // tcp socket the reverse proxies register on, -1 with socketpairs
+struct Registrations rp_registering; // reverse proxies connected over tcp that haven't registered yet
+int rp_sockets[MAX_RP] = {-1}; // socket for each reverse proxy
+pid_t rp_p_ids[MAX_RP] = {0}; // an array for the process ids for each reverse proxy
+struct RpLink rp_links[MAX_RP]; // outbound priority queue, reported depth and window of each reverse proxy
+struct IoBuf rp_out[MAX_RP]; // requests taken from the queue but not yet written to each reverse proxy
+struct IoBuf rp_in[MAX_RP]; // bytes read from each reverse proxy, may end with a partial message
+volatile sig_atomic_t stats_requested = 0;
+uint64_t trace_seq = 0; // requests seen, source of the trace ids
+int trace_sample = 0; // trace one in this many requests, 0 disables sampling
+struct RateLimiter limiter; // per-client request rate limits
+int successor_fd = -1; // socket to the load balancer we offered our traffic to, -1 if none
+struct timespec successor_deadline; // the handoff is given up if the successor isn't ready by then
 
 // a function to choose between the available reverse proxies when a client request arrives
 int choose_rp(int client_id) {
-    return client_id % INIT_RP;
+    int loads[MAX_RP];
+    route_loads(rp_links, rp_num, loads);
+    return route_choose(client_id, loads, rp_num);
 }
 
 void log_msg(const char* msg) {
+    PROF_SCOPE("log");
     printf(LB_LOG_STR, msg);
 }
 
 // close the reverse proxy sockets
 void cleanup() {
-    for (int rp_idx = 0; rp_idx < INIT_RP; rp_idx++) {
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
         if (rp_sockets[rp_idx] != -1) {
             close(rp_sockets[rp_idx]);
             rp_sockets[rp_idx] = -1;
+            route_detach(&rp_links[rp_idx]);
         }
     }
 }
@@ -53,18 +72,61 @@ void cleanup() {
 
 void handle_sigterm(int sig) {
     cleanup();
+    capture_drain();
+    span_drain();
+    PROF_DUMP();
     const char msg[] = "[LOAD BALANCER]: Received SIGTERM. Terminating\n";
     write(STDERR_FILENO, msg, sizeof(msg)-1);
     _exit(0);
 }
 
+// give the request a trace id and decide whether it is sampled, unless the client asked for tracing itself
+void tag_request(struct Packet* pck) {
+    trace_seq++;
+    if ((pck->flags & PACKET_SAMPLED) && pck->trace_id != 0) return;
+
+    pck->trace_id = ((uint64_t)lb_id << 48) | trace_seq;
+    if (trace_sample > 0 && trace_seq % trace_sample == 0) pck->flags |= PACKET_SAMPLED;
+}
+
+void handle_sigusr2(int sig) {
+    stats_requested = 1;
+}
+
+void log_pool_stats() {
+    struct PoolStats st;
+    pool_stats(&st);
+    char bf[160];
+    snprintf(bf, sizeof(bf), "Pool: %lu allocs, %lu frees, %lu slab mallocs, %lu large mallocs", 
+             st.allocs, st.frees, st.slab_mallocs, st.large_mallocs);
+    log_msg(bf);
+}
+
+// take a connected reverse proxy into use, requests queued for it meanwhile go out on the new socket
+void attach_rp(int rp_idx, int fd) {
+    if (rp_sockets[rp_idx] != -1) close(rp_sockets[rp_idx]);
+    rp_sockets[rp_idx] = fd;
+    rp_out[rp_idx].start = rp_out[rp_idx].end = 0;
+    rp_in[rp_idx].start = rp_in[rp_idx].end = 0;
+    route_attach(&rp_links[rp_idx]);
+
+    // writes must not stall the loop, a full socket leaves the requests queued
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
 void start_reverse_proxies() {
-    for (int rp_id = 0; rp_id < INIT_RP; rp_id++) {
-        int sv[2]; // socket pair
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
-            printf("socketpair error %d\n", rp_id);
-            perror("socketpair");
-            exit(EXIT_FAILURE);
+    for (int rp_id = 0; rp_id < rp_num; rp_id++) {
+        int sv[2] = {-1, -1}; // socket pair
+        char endpoint[64]; // how the child reaches us: the inherited descriptor or our tcp address
+        if (rp_listen_fd == -1) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+                printf("socketpair error %d\n", rp_id);
+                perror("socketpair");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(endpoint, sizeof(endpoint), "%d", sv[1]);
+        } else {
+            transport_endpoint(endpoint, sizeof(endpoint), transport_port(LOAD_BALANCER, lb_id));
         }
 
         pid_t p_id = fork();
@@ -74,38 +136,175 @@ void start_reverse_proxies() {
             exit(EXIT_FAILURE);
         } else if (p_id == 0) {
             // Child process: exec reverse_proxy
-            close(sv[0]);
+            if (sv[0] != -1) close(sv[0]);
 
-            char index_str[10], fd_str[10];
-            snprintf(index_str, sizeof(index_str), "%d", rp_id + lb_id * INIT_RP);
-            snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+            char index_str[10];
+            snprintf(index_str, sizeof(index_str), "%d", rp_id + lb_id * rp_num);
 
-            execl("./reverse_proxy", "reverse_proxy", index_str, fd_str, NULL);
+            execl("./reverse_proxy", "reverse_proxy", index_str, endpoint, NULL);
             perror("execl");
             _exit(EXIT_FAILURE);
         } else {
-            // Parent process
-            close(sv[1]);
-            rp_sockets[rp_id] = sv[0];
+            // Parent process, over tcp the child shows up on the listening socket instead
             rp_p_ids[rp_id] = p_id;
+            if (sv[1] != -1) {
+                close(sv[1]);
+                attach_rp(rp_id, sv[0]);
+            }
         }
     }
 }
 
-int main(int argc, char* argv[]) {
-    // check if the load balancer script was called in the right way
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <load_balancer_id> <socket_fd>\n", argv[0]);
-        return 1;
+// a reverse proxy connected over tcp, its first message says which one it is
+void register_rp(int fd, const struct UpMsg* reg) {
+    if (reg->kind != UP_INFORM) {
+        log_msg("Reverse proxy connection didn't register, closing it");
+        close(fd);
+        return;
     }
 
-    // activate sigterm signal handler
-    signal(SIGTERM, handle_sigterm);
+    struct ProcessInform inf = reg->inf;
+    int rp_idx = inf.p_idx - lb_id * rp_num;
+    if (inf.type != REVERSE_PROXY || rp_idx < 0 || rp_idx >= rp_num) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "Rejecting registration of %d as Reverse Proxy slot %d", inf.p_idx, rp_idx);
+        log_msg(msg);
+        close(fd);
+        return;
+    }
 
-    lb_id = atoi(argv[1]); // extract load balancer id
-    wd_fd = atoi(argv[2]); // extract the socket to communicate with the watchdog
+    attach_rp(rp_idx, fd);
+    rp_p_ids[rp_idx] = inf.p_id;
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Reverse Proxy %d registered over tcp", rp_idx);
+    log_msg(msg);
+
+    if (write(wd_fd, &inf, sizeof(inf)) != sizeof(inf)) {
+        perror("write to wd");
+    }
+}
+
+// add a request to the outbound batch of the reverse proxy, -1 once the batch is full
+int batch_request(void* ctx, int rp_idx, const struct Packet* pck) {
+    struct IoBuf* out = &rp_out[rp_idx];
+    if (out->end + sizeof(*pck) > out->cap) return -1;
+
+    memcpy(out->data + out->end, pck, sizeof(*pck));
+    out->end += sizeof(*pck);
+    span_stamp(pck, SPAN_DISPATCH);
+
+    char bf[128];
+    snprintf(bf, sizeof(bf), "Request from Client %d. Forwarding to Reverse Proxy %d", 
+             pck->client_id, rp_idx);
+    log_msg(bf);
+    return 0;
+}
+
+// send queued requests to the reverse proxy in priority order until its window or its socket is full
+// requests are batched into the outbound buffer so a backlog goes out with few writes
+// the window keeps a backlog in our queues, where priorities apply, instead of the socket's fifo buffer
+void flush_rp(int rp_idx) {
+    PROF_SCOPE("flush_rp");
+    struct IoBuf* out = &rp_out[rp_idx];
+
+    while (1) {
+        if (out->start == out->end) {
+            out->start = out->end = 0;
+            route_forward(&rp_links[rp_idx], rp_idx, batch_request, NULL);
+            if (out->end == 0) return;
+        }
+
+        PROF_BEGIN("write");
+        ssize_t bytes_written = write(rp_sockets[rp_idx], out->data + out->start, out->end - out->start);
+        PROF_END();
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+
+            char err_buf[128];
+            snprintf(err_buf, sizeof(err_buf), "Failed to forward to RP %d, dropping %zu bytes", 
+                     rp_idx, out->end - out->start);
+            log_msg(err_buf);
+            out->start = out->end = 0;
+            return;
+        }
+        out->start += bytes_written;
+    }
+}
+
+// give a request an overloaded reverse proxy handed back to the least loaded other one
+void redistribute(struct Packet* pck, int from_idx) {
+    int rp_idx = route_hand_back(rp_links, rp_num, from_idx, pck);
+    if (rp_idx == -1) {
+        char err_buf[128];
+        snprintf(err_buf, sizeof(err_buf), "Queue of class %d is full, dropping request moved from RP %d", 
+                 packet_class(pck), from_idx);
+        log_msg(err_buf);
+        return;
+    }
+
+    char bf[128];
+    snprintf(bf, sizeof(bf), "Moving request of Client %d from Reverse Proxy %d to %d", 
+             pck->client_id, from_idx, rp_idx);
+    log_msg(bf);
+    if (rp_sockets[rp_idx] != -1) flush_rp(rp_idx);
+}
 
-    int lb_fd; // socket
+// handle the messages a reverse proxy sent up
+void read_rp(int rp_idx) {
+    PROF_SCOPE("read_rp");
+    struct IoBuf* in = &rp_in[rp_idx];
+    iobuf_compact(in);
+    PROF_BEGIN("read");
+    ssize_t bytes_read = read(rp_sockets[rp_idx], in->data + in->end, in->cap - in->end);
+    PROF_END();
+
+    if (bytes_read == 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Reverse Proxy %d disconnected", rp_idx);
+        log_msg(msg);
+        close(rp_sockets[rp_idx]);
+        rp_sockets[rp_idx] = -1;
+        route_detach(&rp_links[rp_idx]);
+        return;
+    }
+    if (bytes_read < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) perror("read from rp");
+        return;
+    }
+    in->end += bytes_read;
+
+    int credits = rp_links[rp_idx].credits;
+    while (in->end - in->start >= sizeof(struct UpMsg)) {
+        struct UpMsg msg;
+        memcpy(&msg, in->data + in->start, sizeof(msg));
+        in->start += sizeof(msg);
+
+        switch (msg.kind)
+        {
+        case UP_INFORM:
+            if (write(wd_fd, &msg.inf, sizeof(msg.inf)) != sizeof(msg.inf)) {
+                perror("write to wd");
+            }
+            break;
+        case UP_LOAD:
+            route_report(&rp_links[rp_idx], &msg.load);
+            break;
+        case UP_PUSHBACK:
+            redistribute(&msg.pck, rp_idx);
+            break;
+        default:
+            fprintf(stderr, "Unknown message %d from RP %d\n", msg.kind, rp_idx);
+            break;
+        }
+    }
+
+    if (rp_links[rp_idx].credits > credits) flush_rp(rp_idx);
+}
+
+// bind the socket the clients connect to, replacing a stale one
+void listen_clients() {
     struct sockaddr_un addr;
 
     // clear the socket
@@ -130,41 +329,452 @@ int main(int argc, char* argv[]) {
         perror("listen");
         exit(1);
     }
+}
+
+void deadline_after(struct timespec* deadline, int ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000l;
+    if (deadline->tv_nsec >= 1000000000l) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000l;
+    }
+}
+
+long long ms_until(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000ll + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+// offer our traffic to a successor, we keep serving from the loop until it is ready for it
+void offer_handoff(int fd) {
+    if (successor_fd != -1) {
+        log_msg("Already handing over, turning another successor away");
+        close(fd);
+        return;
+    }
+
+    struct HandoffOffer offer = {rp_num};
+    if (write(fd, &offer, sizeof(offer)) != sizeof(offer)) {
+        perror("write handoff offer");
+        close(fd);
+        return;
+    }
+    successor_fd = fd;
+    deadline_after(&successor_deadline, HANDOFF_READY_TIMEOUT_MS);
+    log_msg("Offered the traffic to a new load balancer");
+}
+
+// the successor hasn't touched anything yet, so we simply carry on
+void abandon_handoff(const char* reason) {
+    close(successor_fd);
+    successor_fd = -1;
+
+    char bf[128];
+    snprintf(bf, sizeof(bf), "Handoff failed, %s. Keeping the traffic", reason);
+    log_msg(bf);
+}
+
+// write what the reverse proxies take within HANDOFF_DRAIN_MS, their messages are left to the successor
+void drain_rps() {
+    struct timespec deadline;
+    deadline_after(&deadline, HANDOFF_DRAIN_MS);
+
+    while (1) {
+        struct pollfd pfds[MAX_RP];
+        int n = 0;
+        for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+            if (rp_sockets[rp_idx] == -1) continue;
+
+            flush_rp(rp_idx);
+            if (rp_sockets[rp_idx] != -1 && rp_out[rp_idx].start != rp_out[rp_idx].end) {
+                pfds[n].fd = rp_sockets[rp_idx];
+                pfds[n].events = POLLOUT;
+                pfds[n++].revents = 0;
+            }
+        }
+
+        long long ms = ms_until(&deadline);
+        if (n == 0 || ms <= 0) return;
+        if (poll(pfds, n, ms) < 0 && errno != EINTR) {
+            perror("poll");
+            return;
+        }
+    }
+}
+
+// stop serving and pass the client socket, the reverse proxy connections, what is left of their batches and
+// the queued requests to the successor, then exit; a commit that doesn't go through completely is never used
+void commit_handoff() {
+    drain_rps();
+
+    static struct HandoffState st;
+    memset(&st, 0, sizeof(st));
+    int fds[HANDOFF_MAX_FDS], nfds = 0;
+    fds[nfds++] = lb_fd;
+    if (rp_listen_fd != -1) {
+        st.has_rp_listen = 1;
+        fds[nfds++] = rp_listen_fd;
+    }
+
+    st.rp_num = rp_num;
+    st.trace_seq = trace_seq;
+    int total = 0;
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        total += rp_links[rp_idx].queue.pending;
+        if (rp_sockets[rp_idx] == -1) continue;
+
+        st.rp_connected[rp_idx] = 1;
+        fds[nfds++] = rp_sockets[rp_idx];
+        st.rp_p_ids[rp_idx] = rp_p_ids[rp_idx];
+        st.rp_reported[rp_idx] = rp_links[rp_idx].reported;
+        st.rp_credits[rp_idx] = rp_links[rp_idx].credits;
+
+        struct IoBuf* out = &rp_out[rp_idx];
+        st.rp_out_len[rp_idx] = out->end - out->start;
+        memcpy(st.rp_out[rp_idx], out->data + out->start, st.rp_out_len[rp_idx]);
+
+        struct IoBuf* in = &rp_in[rp_idx];
+        st.rp_in_len[rp_idx] = in->end - in->start;
+        memcpy(st.rp_in[rp_idx], in->data + in->start, st.rp_in_len[rp_idx]);
+    }
+
+    // the queued requests leave our queues, they are put back if the commit fails
+    struct HandoffRequest* reqs = malloc((total + 1) * sizeof(*reqs));
+    if (reqs == NULL) {
+        perror("malloc");
+        abandon_handoff("out of memory");
+        return;
+    }
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        struct Packet* pck;
+        while ((pck = sched_peek(&rp_links[rp_idx].queue)) != NULL) {
+            reqs[st.queued].rp_idx = rp_idx;
+            reqs[st.queued++].pck = *pck;
+            sched_pop(&rp_links[rp_idx].queue);
+        }
+    }
+
+    int ok = send_with_fds(successor_fd, &st, sizeof(st), fds, nfds) == 0 &&
+             send_with_fds(successor_fd, reqs, st.queued * sizeof(*reqs), NULL, 0) == 0;
+
+    if (ok) {
+        close(successor_fd);
+        char bf[96];
+        snprintf(bf, sizeof(bf), "Handed over %d reverse proxies and %d queued requests. Exiting", 
+                 nfds - 1 - st.has_rp_listen, st.queued);
+        log_msg(bf);
+        capture_close();
+        span_close();
+        exit(0);
+    }
+
+    abandon_handoff("the commit didn't go through");
+    for (int i = 0; i < st.queued; i++) {
+        sched_enqueue(&rp_links[reqs[i].rp_idx].queue, &reqs[i].pck);
+    }
+    free(reqs);
+}
+
+// the successor only ever says it is ready, anything else means it gave up
+void read_successor() {
+    char ready;
+    ssize_t n = read(successor_fd, &ready, 1);
+    if (n < 0 && errno == EINTR) return;
+
+    if (n == 1 && ready == HANDOFF_READY) {
+        commit_handoff();
+    } else {
+        abandon_handoff("the new load balancer gave up");
+    }
+}
+
+// take over from the load balancer we replace: its sockets, unsent bytes and queued requests
+// nothing is used before its commit has fully arrived, until then it may still keep the traffic
+void take_over(int handoff_fd) {
+    // a predecessor that never answers (stuck, or too old to read the watchdog) must not keep us waiting,
+    // the watchdog puts it back in charge once we exit
+    struct HandoffOffer offer;
+    struct pollfd pfd = { handoff_fd, POLLIN, 0 };
+    int ready;
+    while ((ready = poll(&pfd, 1, HANDOFF_READY_TIMEOUT_MS)) < 0 && errno == EINTR);
+    if (ready != 1) {
+        log_msg("The previous load balancer didn't offer its traffic in time");
+        exit(1);
+    }
+    if (read_full(handoff_fd, &offer, sizeof(offer)) != sizeof(offer) || offer.rp_num != rp_num) {
+        log_msg("Can't take over from the previous load balancer");
+        exit(1);
+    }
+    char ack = HANDOFF_READY;
+    if (write(handoff_fd, &ack, 1) != 1) {
+        perror("write handoff ready");
+        exit(1);
+    }
+
+    static struct HandoffState st;
+    int fds[HANDOFF_MAX_FDS], nfds;
+    ssize_t n = recv_with_fds(handoff_fd, &st, sizeof(st), fds, &nfds, HANDOFF_MAX_FDS);
+    if (n > 0 && n < sizeof(st) && read_full(handoff_fd, (char*)&st + n, sizeof(st) - n) == sizeof(st) - n) {
+        n = sizeof(st);
+    }
+    if (n != sizeof(st) || nfds < 1 + st.has_rp_listen || st.rp_num != rp_num) {
+        log_msg("The previous load balancer kept the traffic");
+        exit(1);
+    }
+    for (int i = 0; i < st.queued; i++) {
+        struct HandoffRequest req;
+        if (read_full(handoff_fd, &req, sizeof(req)) != sizeof(req)) {
+            log_msg("The previous load balancer kept the traffic");
+            exit(1);
+        }
+        if (req.rp_idx >= 0 && req.rp_idx < rp_num && sched_enqueue(&rp_links[req.rp_idx].queue, &req.pck) < 0) {
+            char err_buf[128];
+            snprintf(err_buf, sizeof(err_buf), "Queue of class %d for RP %d is full, dropping handed over request", 
+                     packet_class(&req.pck), req.rp_idx);
+            log_msg(err_buf);
+        }
+    }
+    close(handoff_fd);
+
+    int next = 0;
+    lb_fd = fds[next++];
+    if (st.has_rp_listen) rp_listen_fd = fds[next++];
+
+    for (int rp_idx = 0; rp_idx < rp_num && next < nfds; rp_idx++) {
+        if (!st.rp_connected[rp_idx]) continue;
+
+        attach_rp(rp_idx, fds[next++]);
+        rp_p_ids[rp_idx] = st.rp_p_ids[rp_idx];
+        rp_links[rp_idx].reported = st.rp_reported[rp_idx];
+        rp_links[rp_idx].credits = st.rp_credits[rp_idx];
+
+        // the batch may have been cut mid request, all of it has to go out or the stream falls apart
+        uint32_t out_len = st.rp_out_len[rp_idx];
+        if (out_len > rp_out[rp_idx].cap) {
+            iobuf_release(&rp_out[rp_idx]);
+            if (out_len > HANDOFF_OUT_BYTES || iobuf_init(&rp_out[rp_idx], out_len) < 0) {
+                char err_buf[128];
+                snprintf(err_buf, sizeof(err_buf), "Can't hold the %u unsent bytes for RP %d, dropping them", 
+                         out_len, rp_idx);
+                log_msg(err_buf);
+                iobuf_init(&rp_out[rp_idx], RP_BATCH_BYTES);
+                out_len = 0;
+            }
+        }
+        memcpy(rp_out[rp_idx].data, st.rp_out[rp_idx], out_len);
+        rp_out[rp_idx].end = out_len;
+
+        uint32_t in_len = st.rp_in_len[rp_idx];
+        if (in_len > sizeof(st.rp_in[rp_idx]) || in_len > rp_in[rp_idx].cap) {
+            char err_buf[128];
+            snprintf(err_buf, sizeof(err_buf), "Can't hold the %u bytes read from RP %d, dropping them", 
+                     in_len, rp_idx);
+            log_msg(err_buf);
+            in_len = 0;
+        }
+        memcpy(rp_in[rp_idx].data, st.rp_in[rp_idx], in_len);
+        rp_in[rp_idx].end = in_len;
+    }
+    trace_seq = st.trace_seq;
+
+    char bf[96];
+    snprintf(bf, sizeof(bf), "Took over %d reverse proxies and %d queued requests", 
+             nfds - 1 - st.has_rp_listen, st.queued);
+    log_msg(bf);
+}
+
+// the watchdog only ever asks for a handoff, with the socket to our successor attached
+void read_wd() {
+    char cmd;
+    int fd, nfds;
+    ssize_t n = recv_with_fds(wd_fd, &cmd, 1, &fd, &nfds, 1);
+    if (n == 0) {
+        log_msg("Watchdog closed the socket");
+        wd_commands = 0;
+        return;
+    }
+    if (n < 0) {
+        if (errno != EINTR) perror("read from wd");
+        return;
+    }
+
+    if (cmd == HANDOFF_CMD && nfds == 1) {
+        offer_handoff(fd);
+    } else if (nfds == 1) {
+        close(fd);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // check if the load balancer script was called in the right way
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <load_balancer_id> <socket_fd> [handoff_fd]\n", argv[0]);
+        return 1;
+    }
+
+    // activate sigterm signal handler
+    signal(SIGTERM, handle_sigterm);
+    signal(SIGUSR2, handle_sigusr2);
+    // a reverse proxy going away must show up as a failed write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    PROF_INIT("load_balancer");
+
+    lb_id = atoi(argv[1]); // extract load balancer id
+    rp_num = rp_amount();
+    wd_fd = atoi(argv[2]); // extract the socket to communicate with the watchdog
+    // our children must not hold it, the watchdog sees our exit after a handoff as its end closing
+    fcntl(wd_fd, F_SETFD, FD_CLOEXEC);
+    int handoff_fd = argc == 4 ? atoi(argv[3]) : -1; // set when we replace a running load balancer
+
+    // a successor gets the bound socket from its predecessor, clients keep connecting meanwhile
+    if (handoff_fd == -1) listen_clients();
 
     log_msg("Started");
 
-    struct ProcessInform lb_inf = {LOAD_BALANCER, lb_id, getpid()};
+    struct ProcessInform lb_inf = {LOAD_BALANCER, lb_id, getpid(), placement_pin(LOAD_BALANCER, lb_id)};
     if (write(wd_fd, &lb_inf, sizeof(lb_inf)) != sizeof(lb_inf)) {
         perror("write to wd");
     }
 
-    start_reverse_proxies();
+    rate_init(&limiter);
+    registrations_init(&rp_registering, sizeof(struct UpMsg));
+    for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+        rp_sockets[rp_idx] = -1;
+        route_link_init(&rp_links[rp_idx]);
+        if (iobuf_init(&rp_out[rp_idx], RP_BATCH_BYTES) < 0 || iobuf_init(&rp_in[rp_idx], RP_READ_BYTES) < 0) {
+            perror("iobuf_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (handoff_fd != -1) {
+        // files the predecessor wrote to are continued, not started over
+        ring_continue_files(1);
+        take_over(handoff_fd);
+    } else if (transport_kind() == TRANSPORT_TCP) {
+        int port = transport_port(LOAD_BALANCER, lb_id);
+        rp_listen_fd = transport_listen(port);
+        if (rp_listen_fd < 0) {
+            perror("listen tcp");
+            exit(1);
+        }
+        char bf[64];
+        snprintf(bf, sizeof(bf), "Reverse proxies register on tcp port %d", port);
+        log_msg(bf);
+    }
+
+    if (handoff_fd == -1 && (rp_listen_fd == -1 || transport_spawn_local())) start_reverse_proxies();
+
+    // optionally record every incoming request for later replay
+    const char* capture_path = getenv(CAPTURE_ENV);
+    if (capture_path != NULL) {
+        if (capture_open(capture_path) < 0) {
+            perror("capture_open");
+        } else {
+            char bf[256];
+            snprintf(bf, sizeof(bf), "Capturing requests to %s", capture_path);
+            log_msg(bf);
+        }
+    }
+
+    // optionally write the spans of sampled requests for end to end tracing
+    const char* sample_str = getenv(SPAN_SAMPLE_ENV);
+    if (sample_str != NULL) trace_sample = atoi(sample_str);
+    if (span_open(LOAD_BALANCER, lb_id) < 0) {
+        perror("span_open");
+    }
 
     while (1) {
-        fd_set read_fds;
+        if (stats_requested) {
+            stats_requested = 0;
+            log_pool_stats();
+        }
+
+        fd_set read_fds, write_fds;
         int max_fd = lb_fd;
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
         // Add client socket to the set
         FD_SET(lb_fd, &read_fds);
+        if (wd_commands) {
+            FD_SET(wd_fd, &read_fds);
+            if (wd_fd > max_fd) max_fd = wd_fd;
+        }
+        if (rp_listen_fd != -1) {
+            FD_SET(rp_listen_fd, &read_fds);
+            if (rp_listen_fd > max_fd) max_fd = rp_listen_fd;
+        }
 
-        // Add all reverse proxy sockets to the set
-        for (int i = 0; i < INIT_RP; i++) {
+        // Add all reverse proxy sockets to the set, wait for writability only if requests are queued
+        for (int i = 0; i < rp_num; i++) {
             if (rp_sockets[i] != -1) {
                 FD_SET(rp_sockets[i], &read_fds);
+                if ((rp_links[i].queue.pending > 0 && rp_links[i].credits > 0) || rp_out[i].start != rp_out[i].end) {
+                    FD_SET(rp_sockets[i], &write_fds);
+                }
                 if (rp_sockets[i] > max_fd) max_fd = rp_sockets[i];
             }
             
         }
 
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        struct timeval timeout = {-1, 0};
+        max_fd = registrations_watch(&rp_registering, &read_fds, max_fd, &timeout);
+        if (successor_fd != -1) {
+            FD_SET(successor_fd, &read_fds);
+            if (successor_fd > max_fd) max_fd = successor_fd;
+            long long ms = ms_until(&successor_deadline);
+            if (ms < 0) ms = 0;
+            if (timeout.tv_sec < 0 || ms < timeout.tv_sec * 1000ll + timeout.tv_usec / 1000) {
+                timeout.tv_sec = ms / 1000;
+                timeout.tv_usec = (ms % 1000) * 1000;
+            }
+        }
+
+        PROF_BEGIN("wait");
+        int activity = select(max_fd + 1, &read_fds, &write_fds, NULL, timeout.tv_sec < 0 ? NULL : &timeout);
+        PROF_END();
         if (activity < 0) {
-            perror("select");
+            if (errno != EINTR) perror("select");
             continue;
         }
 
+        if (wd_commands && FD_ISSET(wd_fd, &read_fds)) {
+            read_wd();
+        }
+
+        // serving goes on while a successor gets ready, it only stops once we commit the handoff
+        if (successor_fd != -1) {
+            if (FD_ISSET(successor_fd, &read_fds)) {
+                read_successor();
+            } else if (ms_until(&successor_deadline) <= 0) {
+                abandon_handoff("the new load balancer wasn't ready in time");
+            }
+        }
+
+        // registrations trickle in without blocking the loop, silent connections are dropped at their deadline
+        int dropped = 0;
+        if (rp_listen_fd != -1 && FD_ISSET(rp_listen_fd, &read_fds)) {
+            dropped += registrations_accept(&rp_registering, rp_listen_fd);
+        }
+        dropped += registrations_read(&rp_registering, &read_fds);
+        if (dropped > 0) {
+            char bf[96];
+            snprintf(bf, sizeof(bf), "Closed %d reverse proxy connections that didn't register", dropped);
+            log_msg(bf);
+        }
+        struct UpMsg reg;
+        int reg_fd;
+        while ((reg_fd = registrations_next(&rp_registering, &reg)) != -1) {
+            register_rp(reg_fd, &reg);
+        }
+
         // check for client message
         if (FD_ISSET(lb_fd, &read_fds)) {
+            PROF_BEGIN("accept");
             int cl_sc = accept(lb_fd, NULL, NULL);
+            PROF_END();
             if (cl_sc < 0) {
                 perror("accept");
                 continue;
@@ -172,6 +782,7 @@ int main(int argc, char* argv[]) {
 
             struct Packet pck;
             ssize_t bytes_read;
+            PROF_BEGIN("read_client");
             while ((bytes_read = read(cl_sc, &pck, sizeof(pck)))) {
                 if (bytes_read == sizeof(pck)) break;
                 if (bytes_read < 0 && errno != EINTR) {
@@ -179,13 +790,32 @@ int main(int argc, char* argv[]) {
                     break;
                 }
             }
+            PROF_END();
 
             if (bytes_read != sizeof(pck)) {
                 close(cl_sc);
                 continue;
             }
 
+            PROF_BEGIN("trace");
+            capture_packet(&pck);
+            tag_request(&pck);
+            span_stamp(&pck, SPAN_ENTER);
+            PROF_END();
+
+            PROF_BEGIN("route");
+            int allowed = rate_allow(&limiter, pck.client_id);
             int rp_idx = choose_rp(pck.client_id);
+            PROF_END();
+
+            if (!allowed) {
+                char err_buf[128];
+                snprintf(err_buf, sizeof(err_buf), "Client %d is over its rate limit, dropping request", pck.client_id);
+                log_msg(err_buf);
+                close(cl_sc);
+                continue;
+            }
+
             if (rp_sockets[rp_idx] == -1) {
                 char err_buf[128];
                 snprintf(err_buf, sizeof(err_buf), "RP %d socket closed, cannot forward", rp_idx);
@@ -194,53 +824,37 @@ int main(int argc, char* argv[]) {
                 continue;
             }
 
-            ssize_t bytes_written = write(rp_sockets[rp_idx], &pck, sizeof(pck));
-            if (bytes_written != sizeof(pck)) {
+            if (sched_enqueue(&rp_links[rp_idx].queue, &pck) < 0) {
                 char err_buf[128];
-                snprintf(err_buf, sizeof(err_buf), "Failed to forward to RP %d (%zd/%zu)", 
-                         rp_idx, bytes_written, sizeof(pck));
+                snprintf(err_buf, sizeof(err_buf), "Queue of class %d for RP %d is full, dropping request", 
+                         packet_class(&pck), rp_idx);
                 log_msg(err_buf);
             } else {
-                char bf[128];
-                snprintf(bf, sizeof(bf), "Request from Client %d. Forwarding to Reverse Proxy %d", 
-                         pck.client_id, rp_idx);
-                log_msg(bf);
+                span_stamp(&pck, SPAN_QUEUE);
+                flush_rp(rp_idx);
             }
             // cleanup
             close(cl_sc);
         }
 
+        // drain the queues of the reverse proxies that can take more requests
+        for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
+            if (rp_sockets[rp_idx] != -1 && FD_ISSET(rp_sockets[rp_idx], &write_fds)) {
+                flush_rp(rp_idx);
+            }
+        }
+
         // check for reverse proxy message
-        for (int rp_idx = 0; rp_idx < INIT_RP; rp_idx++) {
+        for (int rp_idx = 0; rp_idx < rp_num; rp_idx++) {
             if (rp_sockets[rp_idx] == -1) continue;
             
             if (FD_ISSET(rp_sockets[rp_idx], &read_fds)) {
-                struct ProcessInform inf;
-                ssize_t bytes_read = read(rp_sockets[rp_idx], &inf, sizeof(inf));
-                
-                if (bytes_read == 0) {
-                    char msg[64];
-                    snprintf(msg, sizeof(msg), "Reverse Proxy %d disconnected", rp_idx);
-                    log_msg(msg);
-                    close(rp_sockets[rp_idx]);
-                    rp_sockets[rp_idx] = -1;
-                } 
-                else if (bytes_read == sizeof(inf)) {
-                    ssize_t bytes_written = write(wd_fd, &inf, sizeof(inf));
-                    if (bytes_written != sizeof(inf)) {
-                        perror("write to wd");
-                    }
-                }
-                else if (bytes_read < 0 && errno != EINTR) {
-                    perror("read from rp");
-                }
-                else {
-                    fprintf(stderr, "Incomplete message from RP %d (%zd/%zu)\n", 
-                            rp_idx, bytes_read, sizeof(inf));
-                }
+                read_rp(rp_idx);
             }
         }
     }
 
+    capture_close();
+    span_close();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define POOL_LARGE POOL_CLASSES // class index of blocks that came straight from malloc
+
+static const size_t class_sizes[POOL_CLASSES] = { 32, 64, 128, 256, 1024, 4096 };
+
+// sits in front of every block, the payload after it stays 16 byte aligned
+struct BlockHeader {
+    _Alignas(16) struct BlockHeader* next; // free list link while the block is free
+    uint32_t cls;
+};
+
+struct FreeList {
+    struct BlockHeader* head;
+    int count;
+};
+
+// free blocks owned by the calling thread, no locking needed
+static __thread struct FreeList local_lists[POOL_CLASSES];
+
+// free blocks shared between threads, refilled from and drained into in batches
+static struct FreeList depot[POOL_CLASSES];
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic unsigned long stat_allocs;
+static _Atomic unsigned long stat_frees;
+static _Atomic unsigned long stat_slab_mallocs;
+static _Atomic unsigned long stat_large_mallocs;
+
+static int size_class(size_t size) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (size <= class_sizes[c]) return c;
+    }
+    return POOL_LARGE;
+}
+
+// move up to n blocks from one list to another
+static void move_blocks(struct FreeList* from, struct FreeList* to, int n) {
+    while (n-- > 0 && from->head != NULL) {
+        struct BlockHeader* b = from->head;
+        from->head = b->next;
+        from->count--;
+        b->next = to->head;
+        to->head = b;
+        to->count++;
+    }
+}
+
+// fill the thread's list of a class, first from the depot and only then with a new slab
+static int refill(int cls) {
+    struct FreeList* list = &local_lists[cls];
+
+    pthread_mutex_lock(&depot_lock);
+    move_blocks(&depot[cls], list, POOL_BATCH);
+    pthread_mutex_unlock(&depot_lock);
+    if (list->head != NULL) return 0;
+
+    // slabs are never given back, the pool only grows up to the peak working set
+    size_t block_size = sizeof(struct BlockHeader) + class_sizes[cls];
+    char* slab = malloc(POOL_SLAB_SIZE);
+    if (slab == NULL) return -1;
+    atomic_fetch_add_explicit(&stat_slab_mallocs, 1, memory_order_relaxed);
+
+    for (size_t off = 0; off + block_size <= POOL_SLAB_SIZE; off += block_size) {
+        struct BlockHeader* b = (struct BlockHeader*)(slab + off);
+        b->cls = cls;
+        b->next = list->head;
+        list->head = b;
+        list->count++;
+    }
+    return 0;
+}
+
+void* pool_alloc(size_t size) {
+    int cls = size_class(size);
+    struct BlockHeader* b;
+
+    if (cls == POOL_LARGE) {
+        b = malloc(sizeof(struct BlockHeader) + size);
+        if (b == NULL) return NULL;
+        b->cls = POOL_LARGE;
+        atomic_fetch_add_explicit(&stat_large_mallocs, 1, memory_order_relaxed);
+    } else {
+        struct FreeList* list = &local_lists[cls];
+        if (list->head == NULL && refill(cls) < 0) return NULL;
+        b = list->head;
+        list->head = b->next;
+        list->count--;
+    }
+
+    atomic_fetch_add_explicit(&stat_allocs, 1, memory_order_relaxed);
+    return b + 1;
+}
+
+void pool_free(void* ptr) {
+    if (ptr == NULL) return;
+
+    struct BlockHeader* b = (struct BlockHeader*)ptr - 1;
+    atomic_fetch_add_explicit(&stat_frees, 1, memory_order_relaxed);
+
+    if (b->cls == POOL_LARGE) {
+        free(b);
+        return;
+    }
+
+    struct FreeList* list = &local_lists[b->cls];
+    b->next = list->head;
+    list->head = b;
+    list->count++;
+
+    // a thread that frees more than it allocates hands the surplus to the others
+    if (list->count > POOL_LOCAL_MAX) {
+        pthread_mutex_lock(&depot_lock);
+        move_blocks(list, &depot[b->cls], POOL_BATCH);
+        pthread_mutex_unlock(&depot_lock);
+    }
+}
+
+void pool_stats(struct PoolStats* stats) {
+    stats->allocs = atomic_load_explicit(&stat_allocs, memory_order_relaxed);
+    stats->frees = atomic_load_explicit(&stat_frees, memory_order_relaxed);
+    stats->slab_mallocs = atomic_load_explicit(&stat_slab_mallocs, memory_order_relaxed);
+    stats->large_mallocs = atomic_load_explicit(&stat_large_mallocs, memory_order_relaxed);
+}
+
+int iobuf_init(struct IoBuf* buf, size_t cap) {
+    buf->data = pool_alloc(cap);
+    if (buf->data == NULL) return -1;
+    buf->cap = cap;
+    buf->start = 0;
+    buf->end = 0;
+    return 0;
+}
+
+// move the pending bytes to the front to make room at the end
+void iobuf_compact(struct IoBuf* buf) {
+    if (buf->start == 0) return;
+    memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+    buf->end -= buf->start;
+    buf->start = 0;
+}
+
+void iobuf_release(struct IoBuf* buf) {
+    pool_free(buf->data);
+    buf->data = NULL;
+    buf->cap = 0;
+    buf->start = 0;
+    buf->end = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_CLASSES 6 // 32, 64, 128, 256, 1024 and 4096 byte blocks
+#define POOL_SLAB_SIZE (64 * 1024) // bytes taken from malloc whenever a class runs dry
+#define POOL_LOCAL_MAX 512 // free blocks a thread keeps per class before returning a batch
+#define POOL_BATCH 128 // blocks moved between a thread and the shared depot at once
+
+// allocation counters, in steady state only allocs and frees should grow
+struct PoolStats {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long slab_mallocs; // slabs carved into blocks
+    unsigned long large_mallocs; // requests bigger than the largest class, served by malloc directly
+};
+
+// a recycled I/O buffer, the bytes in [start, end) are pending
+struct IoBuf {
+    char* data;
+    size_t cap;
+    size_t start;
+    size_t end;
+};
+
+void* pool_alloc(size_t size);
+void pool_free(void* ptr);
+void pool_stats(struct PoolStats* stats);
+
+int iobuf_init(struct IoBuf* buf, size_t cap);
+void iobuf_compact(struct IoBuf* buf);
+void iobuf_release(struct IoBuf* buf);
+
+#endif
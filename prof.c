@@ -0,0 +1,195 @@
+#include "prof.h"
+
+#ifdef DS_PROFILE
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// one node per distinct stack, children are linked through their siblings
+struct ProfNode {
+    const char* stage;
+    int parent;
+    int first_child;
+    int next_sibling;
+    uint64_t start;
+    uint64_t ticks;
+    uint64_t calls;
+};
+
+// the stacks of one thread, only that thread writes them
+struct ProfTable {
+    struct ProfNode nodes[PROF_MAX_NODES];
+    _Atomic int node_count; // nodes below it are complete, a dump from another thread reads up to it
+    int current;
+    int overflow; // stages entered while the node table was full
+};
+
+// tables outlive their threads, so a dump still has the stacks of threads that already exited
+static __thread struct ProfTable* prof_table = NULL;
+static struct ProfTable* _Atomic prof_tables[PROF_MAX_THREADS];
+static _Atomic int prof_table_count = 0;
+
+static char prof_path[256];
+
+// cycles where rdtsc exists, nanoseconds elsewhere
+static inline uint64_t prof_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void handle_sigusr1(int sig) {
+    prof_dump();
+}
+
+void prof_init(const char* name) {
+    const char* dir = getenv(PROF_DIR_ENV);
+    snprintf(prof_path, sizeof(prof_path), "%s/prof-%s-%d.folded", dir != NULL ? dir : "/tmp", name, getpid());
+    signal(SIGUSR1, handle_sigusr1);
+    // a process that returns from main or calls exit dumps too, the SIGTERM handlers _exit after dumping
+    atexit(prof_dump);
+    prof_thread(name);
+}
+
+// give the calling thread its own table, its stacks start at name
+void prof_thread(const char* name) {
+    if (prof_table != NULL) return;
+
+    int slot = atomic_fetch_add(&prof_table_count, 1);
+    if (slot >= PROF_MAX_THREADS) return;
+    struct ProfTable* t = calloc(1, sizeof(*t));
+    if (t == NULL) return;
+
+    t->nodes[0].stage = name;
+    t->nodes[0].parent = -1;
+    t->nodes[0].first_child = -1;
+    t->nodes[0].next_sibling = -1;
+    atomic_store(&t->node_count, 1);
+    prof_table = t;
+    atomic_store(&prof_tables[slot], t);
+}
+
+void prof_begin(const char* stage) {
+    struct ProfTable* t = prof_table;
+    if (t == NULL) return;
+
+    // stage names are literals, so comparing the pointers is almost always enough
+    int child = t->nodes[t->current].first_child;
+    while (child != -1 && t->nodes[child].stage != stage && strcmp(t->nodes[child].stage, stage) != 0) {
+        child = t->nodes[child].next_sibling;
+    }
+
+    if (child == -1) {
+        // out of nodes, the time is charged to the enclosing stage
+        int count = atomic_load_explicit(&t->node_count, memory_order_relaxed);
+        if (count == PROF_MAX_NODES) {
+            t->overflow++;
+            return;
+        }
+        // fill the node before a dump can see it
+        child = count;
+        t->nodes[child].stage = stage;
+        t->nodes[child].parent = t->current;
+        t->nodes[child].first_child = -1;
+        t->nodes[child].next_sibling = t->nodes[t->current].first_child;
+        atomic_store_explicit(&t->node_count, count + 1, memory_order_release);
+        t->nodes[t->current].first_child = child;
+    }
+
+    t->current = child;
+    t->nodes[child].start = prof_clock();
+}
+
+void prof_end() {
+    struct ProfTable* t = prof_table;
+    if (t == NULL) return;
+    if (t->overflow > 0) {
+        t->overflow--;
+        return;
+    }
+    if (t->current <= 0) return;
+
+    struct ProfNode* node = &t->nodes[t->current];
+    node->ticks += prof_clock() - node->start;
+    node->calls++;
+    t->current = node->parent;
+}
+
+void prof_scope_exit(int* unused) {
+    prof_end();
+}
+
+// only write() and hand rolled formatting, so it is safe inside signal handlers
+static size_t append_str(char* buf, size_t len, size_t cap, const char* s) {
+    while (*s && len < cap) buf[len++] = *s++;
+    return len;
+}
+
+static size_t append_u64(char* buf, size_t len, size_t cap, uint64_t v) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0 && len < cap) buf[len++] = digits[--n];
+    return len;
+}
+
+static size_t append_stack(char* buf, size_t len, size_t cap, const struct ProfNode* nodes, int node) {
+    if (nodes[node].parent != -1) {
+        len = append_stack(buf, len, cap, nodes, nodes[node].parent);
+        len = append_str(buf, len, cap, ";");
+    }
+    return append_str(buf, len, cap, nodes[node].stage);
+}
+
+// write the self time of every stack of every thread as "root;stage;substage ticks"
+// other threads keep running, a stage they are in the middle of shows up in the next dump
+void prof_dump() {
+    int tables = atomic_load(&prof_table_count);
+    if (tables == 0 || prof_path[0] == '\0') return;
+    if (tables > PROF_MAX_THREADS) tables = PROF_MAX_THREADS;
+
+    int fd = open(prof_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    for (int t = 0; t < tables; t++) {
+        struct ProfTable* table = atomic_load(&prof_tables[t]);
+        if (table == NULL) continue;
+        const struct ProfNode* nodes = table->nodes;
+        int count = atomic_load_explicit(&table->node_count, memory_order_acquire);
+
+        for (int i = 1; i < count; i++) {
+            uint64_t self = nodes[i].ticks;
+            for (int c = nodes[i].first_child; c != -1 && c < count; c = nodes[c].next_sibling) {
+                self = self > nodes[c].ticks ? self - nodes[c].ticks : 0;
+            }
+            if (nodes[i].calls == 0) continue;
+
+            char line[512];
+            size_t len = append_stack(line, 0, sizeof(line) - 22, nodes, i);
+            len = append_str(line, len, sizeof(line), " ");
+            len = append_u64(line, len, sizeof(line) - 1, self);
+            line[len++] = '\n';
+            write(fd, line, len);
+        }
+    }
+    close(fd);
+}
+
+#endif
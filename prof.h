@@ -0,0 +1,47 @@
+#ifndef PROF_H
+#define PROF_H
+
+// per-stage cycle profiling, built only with `make PROFILE=1` (-DDS_PROFILE)
+// stages nest, the totals are dumped as folded stacks ready for flamegraph.pl:
+//   PROF_INIT("load_balancer");       once per process, names the root of the calling thread's stacks
+//   PROF_THREAD("ring_writer");       in every other thread that should be profiled
+//   PROF_SCOPE("flush_rp");           until the end of the enclosing block
+//   PROF_BEGIN("wait"); ... PROF_END();
+//   PROF_DUMP();                      every thread's stacks, async-signal-safe, also done on SIGUSR1 and at exit
+
+#ifdef DS_PROFILE
+
+#define PROF_MAX_NODES 128 // distinct stacks tracked per thread
+#define PROF_MAX_THREADS 64 // threads with a table, later ones aren't profiled
+#define PROF_DIR_ENV "DS_PROF_DIR" // where prof-<name>-<pid>.folded is written, /tmp by default
+
+void prof_init(const char* name);
+void prof_thread(const char* name);
+void prof_begin(const char* stage);
+void prof_end();
+void prof_dump();
+void prof_scope_exit(int* unused);
+
+#define PROF_CAT2(a, b) a##b
+#define PROF_CAT(a, b) PROF_CAT2(a, b)
+
+#define PROF_INIT(name) prof_init(name)
+#define PROF_THREAD(name) prof_thread(name)
+#define PROF_SCOPE(stage) \
+    int PROF_CAT(prof_scope_, __LINE__) __attribute__((cleanup(prof_scope_exit), unused)) = (prof_begin(stage), 0)
+#define PROF_BEGIN(stage) prof_begin(stage)
+#define PROF_END() prof_end()
+#define PROF_DUMP() prof_dump()
+
+#else
+
+#define PROF_INIT(name) ((void)0)
+#define PROF_THREAD(name) ((void)0)
+#define PROF_SCOPE(stage) ((void)0)
+#define PROF_BEGIN(stage) ((void)0)
+#define PROF_END() ((void)0)
+#define PROF_DUMP() ((void)0)
+
+#endif
+
+#endif
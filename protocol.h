@@ -0,0 +1,48 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum ProcessType { LOAD_BALANCER, REVERSE_PROXY, SERVER };
+
+#define PACKET_SAMPLED 0x1 // the request is traced end to end
+#define PACKET_REDIRECTED 0x2 // the request was handed back by an overloaded reverse proxy, it isn't moved again
+
+// priority classes a request can be tagged with, lower value is served first
+enum Priority { PRIO_HIGH, PRIO_NORMAL, PRIO_LOW, PRIO_COUNT };
+
+struct ProcessInform {
+    enum ProcessType type;
+    int p_idx;
+    pid_t p_id;
+    int cpu; // core the process is pinned to, -1 if the scheduler places it
+};
+
+struct Packet {
+    int client_id;
+    float value;
+    int priority; // one of enum Priority, anything else falls back to the client id based class
+    uint32_t flags; // PACKET_* bits
+    uint64_t trace_id; // assigned by the load balancer unless the client brings its own
+};
+
+// what a reverse proxy sends up to its load balancer
+enum UpKind { UP_INFORM, UP_LOAD, UP_PUSHBACK };
+
+struct LoadReport {
+    int rp_idx;
+    int queued; // requests waiting in the reverse proxy for a server
+    int credits; // requests that left its queue since the last report, each lets one more in
+};
+
+struct UpMsg {
+    enum UpKind kind;
+    union {
+        struct ProcessInform inf; // UP_INFORM: a process of the subtree started
+        struct LoadReport load; // UP_LOAD: queue depth changed
+        struct Packet pck; // UP_PUSHBACK: a queued request to give to another reverse proxy
+    };
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include "queue.h"
+
+#define CELL_HEADER 8 // room for the sequence number in front of each mpsc element
+
+int spsc_init(struct SpscQueue* q, size_t elem_size, size_t cap) {
+    q->buf = malloc(elem_size * cap);
+    if (q->buf == NULL) return -1;
+    q->elem_size = elem_size;
+    q->cap = cap;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+// returns -1 if the queue is full
+int spsc_push(struct SpscQueue* q, const void* elem) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail == q->cap) return -1;
+
+    memcpy(q->buf + (head & (q->cap - 1)) * q->elem_size, elem, q->elem_size);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// returns -1 if the queue is empty
+int spsc_pop(struct SpscQueue* q, void* elem) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head == tail) return -1;
+
+    memcpy(elem, q->buf + (tail & (q->cap - 1)) * q->elem_size, q->elem_size);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+void spsc_free(struct SpscQueue* q) {
+    free(q->buf);
+    q->buf = NULL;
+}
+
+static _Atomic size_t* cell_seq(struct MpscQueue* q, size_t pos) {
+    return (_Atomic size_t*)(q->cells + (pos & (q->cap - 1)) * q->cell_size);
+}
+
+static char* cell_data(struct MpscQueue* q, size_t pos) {
+    return q->cells + (pos & (q->cap - 1)) * q->cell_size + CELL_HEADER;
+}
+
+int mpsc_init(struct MpscQueue* q, size_t elem_size, size_t cap) {
+    q->cell_size = CELL_HEADER + ((elem_size + 7) & ~(size_t)7);
+    q->cells = malloc(q->cell_size * cap);
+    if (q->cells == NULL) return -1;
+    q->elem_size = elem_size;
+    q->cap = cap;
+
+    // cell i is free for the producer that claims position i
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(cell_seq(q, i), i);
+    }
+    atomic_init(&q->enqueue_pos, 0);
+    q->dequeue_pos = 0;
+    return 0;
+}
+
+// returns -1 if the queue is full
+int mpsc_push(struct MpscQueue* q, const void* elem) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    while (1) {
+        size_t seq = atomic_load_explicit(cell_seq(q, pos), memory_order_acquire);
+        long diff = (long)(seq - pos);
+
+        if (diff == 0) {
+            // the cell is free, claim the position (pos is reloaded if another producer was faster)
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell_data(q, pos), elem, q->elem_size);
+    atomic_store_explicit(cell_seq(q, pos), pos + 1, memory_order_release);
+    return 0;
+}
+
+// returns -1 if the queue is empty (or the next element is still being written)
+int mpsc_pop(struct MpscQueue* q, void* elem) {
+    size_t pos = q->dequeue_pos;
+    size_t seq = atomic_load_explicit(cell_seq(q, pos), memory_order_acquire);
+    if (seq != pos + 1) return -1;
+
+    memcpy(elem, cell_data(q, pos), q->elem_size);
+    q->dequeue_pos = pos + 1;
+    // hand the cell to the producer that will claim it one lap later
+    atomic_store_explicit(cell_seq(q, pos), pos + q->cap, memory_order_release);
+    return 0;
+}
+
+void mpsc_free(struct MpscQueue* q) {
+    free(q->cells);
+    q->cells = NULL;
+}
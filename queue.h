@@ -0,0 +1,38 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// bounded lock-free queues of fixed size elements for passing messages between threads
+
+// single producer, single consumer
+struct SpscQueue {
+    char* buf;
+    size_t elem_size;
+    size_t cap; // a power of two
+    _Alignas(64) _Atomic size_t head; // next slot the producer fills
+    _Alignas(64) _Atomic size_t tail; // next slot the consumer empties
+};
+
+// multiple producers, single consumer; every cell carries a sequence number that says whose turn it is
+struct MpscQueue {
+    char* cells;
+    size_t cell_size;
+    size_t elem_size;
+    size_t cap; // a power of two
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) size_t dequeue_pos;
+};
+
+int spsc_init(struct SpscQueue* q, size_t elem_size, size_t cap);
+int spsc_push(struct SpscQueue* q, const void* elem);
+int spsc_pop(struct SpscQueue* q, void* elem);
+void spsc_free(struct SpscQueue* q);
+
+int mpsc_init(struct MpscQueue* q, size_t elem_size, size_t cap);
+int mpsc_push(struct MpscQueue* q, const void* elem);
+int mpsc_pop(struct MpscQueue* q, void* elem);
+void mpsc_free(struct MpscQueue* q);
+
+#endif
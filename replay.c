@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "protocol.h"
+#include "capture.h"
+
+#define CLIENT_SOCKET_PATH "/tmp/cl-lb"   // the socket path for the communication with the load balancer
+#define DEFAULT_CONNECTIONS 8
+#define MAX_CONNECTIONS 256
+
+const struct CaptureRecord* records; // the mmapped records of the trace
+size_t record_count;
+double speed; // 1 replays with the original timing, N is N times faster, 0 doesn't wait at all
+int connections; // amount of concurrent senders
+struct timespec replay_start;
+
+_Atomic unsigned long sent = 0;
+_Atomic unsigned long failed = 0;
+
+// absolute time at which a record is due
+struct timespec due_time(const struct CaptureRecord* rec) {
+    double offset_ns = (double)(rec->ts_ns - records[0].ts_ns) / speed;
+    long long ns = replay_start.tv_nsec + (long long)offset_ns;
+    struct timespec ts = { replay_start.tv_sec + ns / 1000000000ll, ns % 1000000000ll };
+    return ts;
+}
+
+int send_packet(const struct Packet* pck) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CLIENT_SOCKET_PATH, sizeof(addr.sun_path)-1);
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    ssize_t bytes_written = write(sock, pck, sizeof(*pck));
+    close(sock);
+    return bytes_written == sizeof(*pck) ? 0 : -1;
+}
+
+// each sender replays every connections'th record, so the original order is kept across the senders
+void* sender(void* arg) {
+    int idx = (int)(long)arg;
+
+    for (size_t i = idx; i < record_count; i += connections) {
+        const struct CaptureRecord* rec = &records[i];
+        if (speed > 0) {
+            struct timespec due = due_time(rec);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) != 0);
+        }
+
+        struct Packet pck = { rec->client_id, rec->value, rec->priority };
+        if (send_packet(&pck) == 0) {
+            atomic_fetch_add(&sent, 1);
+        } else {
+            atomic_fetch_add(&failed, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    // check if the replay script was called in the right way
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <trace_file> [speed (1 original, N faster, 0 no wait)] [connections]\n", argv[0]);
+        return 1;
+    }
+
+    speed = (argc > 2) ? atof(argv[2]) : 1.0;
+    connections = (argc > 3) ? atoi(argv[3]) : DEFAULT_CONNECTIONS;
+    if (speed < 0 || connections < 1 || connections > MAX_CONNECTIONS) {
+        fprintf(stderr, "Invalid speed or connection amount\n");
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(struct CaptureHeader)) {
+        fprintf(stderr, "Trace file is too short\n");
+        return 1;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    const struct CaptureHeader* header = map;
+    if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+        header->record_size != sizeof(struct CaptureRecord)) {
+        fprintf(stderr, "Not a trace file or unsupported version\n");
+        return 1;
+    }
+
+    if (header->dropped > 0) {
+        fprintf(stderr, "Warning: the capture lost %u requests, the replay is missing them\n", header->dropped);
+    }
+
+    records = (const struct CaptureRecord*)(header + 1);
+    record_count = (st.st_size - sizeof(*header)) / sizeof(struct CaptureRecord);
+    if (record_count == 0) {
+        printf("Trace is empty\n");
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    printf("Replaying %zu requests at speed %.2f over %d connections\n", record_count, speed, connections);
+
+    pthread_t threads[MAX_CONNECTIONS];
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&threads[i], NULL, sender, (void*)(long)i) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - replay_start.tv_sec) + (end.tv_nsec - replay_start.tv_nsec) / 1e9;
+    double original = (records[record_count - 1].ts_ns - records[0].ts_ns) / 1e9;
+
+    printf("Sent %lu, failed %lu in %.3f s (original %.3f s, %.0f req/s)\n",
+           atomic_load(&sent), atomic_load(&failed), elapsed, original,
+           elapsed > 0 ? atomic_load(&sent) / elapsed : 0.0);
+
+    munmap(map, st.st_size);
+    return 0;
+}
@@ -7,38 +7,47 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include "protocol.h"
+#include "sched.h"
+#include "pool.h"
+#include "span.h"
+#include "transport.h"
+#include "prof.h"
+#include "route.h"
+#include "busy_poll.h"
+#include "topology.h"
 
 #define RP_LOG_STR "[REVERSE PROXY %d]: %s\n"
-//#define MAX_SV 10
-#define INIT_SV 3
-
-enum ProcessType { LOAD_BALANCER, REVERSE_PROXY, SERVER };
-
-struct ProcessInform {
-    enum ProcessType type;
-    int p_idx;
-    pid_t p_id;
-};
-
-struct Packet {
-    int client_id;
-    float value;
-};
+#define LB_READ_BYTES 1024 // size of the inbound buffer from the load balancer
+#define SV_READ_BYTES 256 // size of the inbound buffer from each server
+#define SV_SNDBUF 4096 // send buffer of each server socket, a handful of requests
 
 int rp_id; // id for the reverse proxy
 
 int lb_fd; // socket for load balancer
-int sv_sockets[INIT_SV]; // socket for each server
+int sv_num; // servers of this reverse proxy, DS_SV_AMOUNT
+int sv_listen_fd = -1; // tcp socket the servers register on, -1 with socketpairs
+struct Registrations sv_registering; // servers connected over tcp that haven't registered yet
+int sv_sockets[MAX_SV]; // socket for each server
+struct IoBuf sv_in[MAX_SV]; // bytes read from each server, may end with a partial message
+struct IoBuf sv_out[MAX_SV]; // the rest of a request a server's socket only took part of
 
-pid_t sv_p_ids[INIT_SV]; // process id for each server
+pid_t sv_p_ids[MAX_SV]; // process id for each server
+
+struct ProxyQueue proxy; // requests waiting for a free server, in priority order, and the reports about them
+struct IoBuf lb_in; // bytes read from the load balancer, may end with a partial packet
+volatile sig_atomic_t stats_requested = 0;
+struct BusyPoll busy; // spinning before the blocking select, off unless DS_BUSY_POLL_US is set
 
 void log_msg(const char* msg) {
+    PROF_SCOPE("log");
     printf(RP_LOG_STR, rp_id, msg);
 }
 
 // close the open server sockets
 void cleanup() {
-    for (int sv_idx = 0; sv_idx < INIT_SV; sv_idx++) {
+    for (int sv_idx = 0; sv_idx < sv_num; sv_idx++) {
         if (sv_sockets[sv_idx] != -1) {
             close(sv_sockets[sv_idx]);
             sv_sockets[sv_idx] = -1;
@@ -48,18 +57,85 @@ void cleanup() {
 
 void handle_sigterm(int sig) {
     cleanup();
+    span_drain();
+    PROF_DUMP();
     const char msg[] = "[REVERSE PROXY]: Received SIGTERM. Terminating\n";
     write(STDERR_FILENO, msg, sizeof(msg)-1);
     _exit(0);
 }
+
+void handle_sigusr2(int sig) {
+    stats_requested = 1;
+}
+
+void log_pool_stats() {
+    struct PoolStats st;
+    pool_stats(&st);
+    char bf[160];
+    snprintf(bf, sizeof(bf), "Pool: %lu allocs, %lu frees, %lu slab mallocs, %lu large mallocs", 
+             st.allocs, st.frees, st.slab_mallocs, st.large_mallocs);
+    log_msg(bf);
+}
+
+// ctx is unused, the load balancer's socket is global
+int send_up(void* ctx, const struct UpMsg* msg) {
+    if (write(lb_fd, msg, sizeof(*msg)) != sizeof(*msg)) {
+        perror("write to lb");
+        return -1;
+    }
+    return 0;
+}
+
+void send_inform(const struct ProcessInform* inf) {
+    struct UpMsg msg = { .kind = UP_INFORM, .inf = *inf };
+    send_up(NULL, &msg);
+}
+
+// tell the load balancer about queue depth changes and give back what the servers can't keep up with
+void rebalance() {
+    PROF_SCOPE("rebalance");
+    int moved = route_rebalance(&proxy, rp_id, send_up, NULL);
+    if (moved > 0) {
+        char bf[64];
+        snprintf(bf, sizeof(bf), "Overloaded, handed %d requests back", moved);
+        log_msg(bf);
+    }
+}
+
+// take a connected server into use
+void attach_server(int sv_idx, int fd) {
+    if (sv_sockets[sv_idx] != -1) close(sv_sockets[sv_idx]);
+    sv_sockets[sv_idx] = fd;
+    sv_in[sv_idx].start = sv_in[sv_idx].end = 0;
+    sv_out[sv_idx].start = sv_out[sv_idx].end = 0;
+
+    // a busy server must not block the proxy, its requests stay queued instead
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // servers don't acknowledge requests, a small send buffer is their window so a backlog stays in our queue
+    int sndbuf = SV_SNDBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) perror("setsockopt SO_SNDBUF");
+}
  
+// a server that went away, what it didn't take of a request is lost with it
+void close_server(int sv_idx) {
+    close(sv_sockets[sv_idx]);
+    sv_sockets[sv_idx] = -1;
+    sv_out[sv_idx].start = sv_out[sv_idx].end = 0;
+}
+
 void start_servers() {
-    for (int sv_id = 0; sv_id < INIT_SV; sv_id++) {
-        int sv[2]; // socket pair
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
-            printf("socketpair error %d\n", sv_id); 
-            perror("socketpair");
-            exit(EXIT_FAILURE);
+    for (int sv_id = 0; sv_id < sv_num; sv_id++) {
+        int sv[2] = {-1, -1}; // socket pair
+        char endpoint[64]; // how the child reaches us: the inherited descriptor or our tcp address
+        if (sv_listen_fd == -1) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+                printf("socketpair error %d\n", sv_id); 
+                perror("socketpair");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(endpoint, sizeof(endpoint), "%d", sv[1]);
+        } else {
+            transport_endpoint(endpoint, sizeof(endpoint), transport_port(REVERSE_PROXY, rp_id));
         }
 
         pid_t p_id = fork();
@@ -69,36 +145,159 @@ void start_servers() {
             exit(EXIT_FAILURE);
         } else if (p_id == 0) {
             // Child process: exec server
-            close(sv[0]);
+            if (sv[0] != -1) close(sv[0]);
 
-            char index_str[10], fd_str[10];
-            snprintf(index_str, sizeof(index_str), "%d", sv_id + rp_id * INIT_SV);
-            snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+            char index_str[10];
+            snprintf(index_str, sizeof(index_str), "%d", sv_id + rp_id * sv_num);
 
-            execl("./server", "server", index_str, fd_str, NULL);
+            execl("./server", "server", index_str, endpoint, NULL);
             perror("execl");
             _exit(EXIT_FAILURE);
         } else {
-            // Parent process
-            close(sv[1]);
-            sv_sockets[sv_id] = sv[0];
+            // Parent process, over tcp the child shows up on the listening socket instead
             sv_p_ids[sv_id] = p_id;
+            if (sv[1] != -1) {
+                close(sv[1]);
+                attach_server(sv_id, sv[0]);
+            }
         }
     }
 }
 
+// a server connected over tcp, its first message says which one it is
+void register_server(int fd, const struct ProcessInform* inf) {
+    PROF_SCOPE("register");
+    int sv_idx = inf->p_idx - rp_id * sv_num;
+    if (inf->type != SERVER || sv_idx < 0 || sv_idx >= sv_num) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "Rejecting registration of %d as Server slot %d", inf->p_idx, sv_idx);
+        log_msg(msg);
+        close(fd);
+        return;
+    }
+
+    attach_server(sv_idx, fd);
+    sv_p_ids[sv_idx] = inf->p_id;
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Server %d registered over tcp", sv_idx);
+    log_msg(msg);
+
+    send_inform(inf);
+}
+
+// pass on the informs a server sent, over tcp a read may end in the middle of one
+void read_sv(int sv_idx) {
+    struct IoBuf* in = &sv_in[sv_idx];
+    iobuf_compact(in);
+    ssize_t bytes_read = read(sv_sockets[sv_idx], in->data + in->end, in->cap - in->end);
+
+    if (bytes_read == 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Server %d disconnected", sv_idx);
+        log_msg(msg);
+        close_server(sv_idx);
+        return;
+    }
+    if (bytes_read < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) perror("read from sv");
+        return;
+    }
+    in->end += bytes_read;
+
+    while (in->end - in->start >= sizeof(struct ProcessInform)) {
+        struct ProcessInform inf;
+        memcpy(&inf, in->data + in->start, sizeof(inf));
+        in->start += sizeof(inf);
+        send_inform(&inf);
+    }
+}
+
+// write the rest of a request a server only took part of, returns 0 once nothing is left
+// only a real error closes the socket, a full one keeps the bytes for the next try
+int flush_sv_out(int sv_idx) {
+    struct IoBuf* out = &sv_out[sv_idx];
+    while (out->start != out->end) {
+        ssize_t bytes_written = write(sv_sockets[sv_idx], out->data + out->start, out->end - out->start);
+        if (bytes_written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Failed to write to server %d, dropping %zu bytes of a request", 
+                     sv_idx, out->end - out->start);
+            log_msg(msg);
+            close_server(sv_idx);
+            return -1;
+        }
+        out->start += bytes_written;
+    }
+    out->start = out->end = 0;
+    return 0;
+}
+
+// write a request to a server, what its socket doesn't take right away stays in sv_out
+// returns -1 if the server is busy or gone, the request then goes to the next one
+int send_to_server(void* ctx, int sv_idx, const struct Packet* pck) {
+    // a server still taking the rest of a request is busy
+    if (sv_sockets[sv_idx] == -1 || sv_out[sv_idx].end != 0) return -1;
+
+    // stamped before the write, the server may run before the write returns
+    span_stamp(pck, SPAN_DISPATCH);
+    PROF_BEGIN("write");
+    ssize_t bytes_written = write(sv_sockets[sv_idx], pck, sizeof(*pck));
+    PROF_END();
+    if (bytes_written < 0) {
+        // Write failed - server disconnected, the request goes to another one
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) close_server(sv_idx);
+        return -1;
+    }
+
+    // a stream socket may take part of the request, the rest goes out once there is room
+    if (bytes_written < sizeof(*pck)) {
+        struct IoBuf* out = &sv_out[sv_idx];
+        out->end = sizeof(*pck) - bytes_written;
+        memcpy(out->data, (const char*)pck + bytes_written, out->end);
+    }
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), 
+                "Forwarded client %d to server %d", 
+                pck->client_id, sv_idx);
+    log_msg(msg);
+    return 0;
+}
+
+// hand queued requests in priority order to the servers (round-robin) until none of them can take more
+void flush_servers() {
+    PROF_SCOPE("flush_servers");
+    for (int sv_idx = 0; sv_idx < sv_num; sv_idx++) {
+        if (sv_sockets[sv_idx] != -1) flush_sv_out(sv_idx);
+    }
+    route_dispatch(&proxy, sv_num, send_to_server, NULL);
+}
+
 int main(int argc, char* argv[]) {
     // check if the reverse proxy script was called in the right way
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s <reverse_proxy_id> <socket_fd>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <reverse_proxy_id> <socket_fd | host:port>\n", argv[0]);
         return 1;
     }
 
     // activate sigterm signal handler
     signal(SIGTERM, handle_sigterm);
+    signal(SIGUSR2, handle_sigusr2);
+    // a server going away must show up as a failed write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    PROF_INIT("reverse_proxy");
 
     rp_id = atoi(argv[1]);
-    lb_fd = atoi(argv[2]);
+    sv_num = sv_amount();
+    lb_fd = transport_connect(argv[2]);
+    if (lb_fd < 0) {
+        perror("connect to lb");
+        exit(1);
+    }
 
     int rp_fd; // socket
 
@@ -110,100 +309,166 @@ int main(int argc, char* argv[]) {
 
     log_msg("Started");
 
-    struct ProcessInform rp_inf = { REVERSE_PROXY, rp_id, getpid() };
-    if (write(lb_fd, &rp_inf, sizeof(rp_inf)) != sizeof(rp_inf)) {
-        perror("write to lb");
+    struct ProcessInform rp_inf = { REVERSE_PROXY, rp_id, getpid(), placement_pin(REVERSE_PROXY, rp_id) };
+    send_inform(&rp_inf);
+
+    route_proxy_init(&proxy);
+    registrations_init(&sv_registering, sizeof(struct ProcessInform));
+    if (iobuf_init(&lb_in, LB_READ_BYTES) < 0) {
+        perror("iobuf_init");
+        exit(1);
+    }
+    for (int sv_idx = 0; sv_idx < sv_num; sv_idx++) {
+        sv_sockets[sv_idx] = -1;
+        if (iobuf_init(&sv_in[sv_idx], SV_READ_BYTES) < 0 || iobuf_init(&sv_out[sv_idx], sizeof(struct Packet)) < 0) {
+            perror("iobuf_init");
+            exit(1);
+        }
     }
 
-    start_servers();
+    if (transport_kind() == TRANSPORT_TCP) {
+        int port = transport_port(REVERSE_PROXY, rp_id);
+        sv_listen_fd = transport_listen(port);
+        if (sv_listen_fd < 0) {
+            perror("listen tcp");
+            exit(1);
+        }
+        char bf[64];
+        snprintf(bf, sizeof(bf), "Servers register on tcp port %d", port);
+        log_msg(bf);
+    }
+
+    if (sv_listen_fd == -1 || transport_spawn_local()) start_servers();
 
-    // round-rubin index for server selection
-    int next_sv_idx = 0;
+    if (span_open(REVERSE_PROXY, rp_id) < 0) {
+        perror("span_open");
+    }
+
+    busy_poll_init(&busy);
+    if (busy.max_ns > 0) {
+        char bf[64];
+        snprintf(bf, sizeof(bf), "Busy polling up to %lld us", (long long)busy.max_ns / 1000);
+        log_msg(bf);
+    }
 
     while (1) {
-        fd_set read_fds;
+        if (stats_requested) {
+            stats_requested = 0;
+            log_pool_stats();
+        }
+
+        fd_set read_fds, write_fds;
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        // the same descriptors for the busy poll
+        struct pollfd pfds[MAX_SV + 2];
+        int npfds = 0;
 
         // add load balancer socket to the set
         FD_SET(lb_fd, &read_fds);
+        pfds[npfds++] = (struct pollfd){ lb_fd, POLLIN, 0 };
         int max_fd = lb_fd;
+        if (sv_listen_fd != -1) {
+            FD_SET(sv_listen_fd, &read_fds);
+            pfds[npfds++] = (struct pollfd){ sv_listen_fd, POLLIN, 0 };
+            if (sv_listen_fd > max_fd) max_fd = sv_listen_fd;
+        }
 
-        // add server sockets to the set
-        for (int i = 0; i < INIT_SV; i++) {
+        // add server sockets to the set, wait for writability only if requests are queued
+        for (int i = 0; i < sv_num; i++) {
             if (sv_sockets[i] != -1) {
                 FD_SET(sv_sockets[i], &read_fds);
+                int sending = proxy.queue.pending > 0 || sv_out[i].end != 0;
+                if (sending) FD_SET(sv_sockets[i], &write_fds);
+                pfds[npfds++] = (struct pollfd){ sv_sockets[i], sending ? POLLIN | POLLOUT : POLLIN, 0 };
                 if (sv_sockets[i] > max_fd) max_fd = sv_sockets[i];
             }
         }
         
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
-        if ((activity < 0) && (errno != EINTR)) {
-            perror("select");
+        // after a successful spin select only collects what is ready
+        PROF_BEGIN("wait");
+        int spun = busy_poll(&busy, pfds, npfds);
+        struct timeval timeout = {spun ? 0 : -1, 0};
+        max_fd = registrations_watch(&sv_registering, &read_fds, max_fd, &timeout);
+        int activity = select(max_fd + 1, &read_fds, &write_fds, NULL, timeout.tv_sec < 0 ? NULL : &timeout);
+        if (!spun) busy_poll_woke(&busy);
+        PROF_END();
+        if (activity < 0) {
+            if (errno != EINTR) perror("select");
             continue;
         }
 
-        // check for load balancer message
+        // registrations trickle in without blocking the loop, silent connections are dropped at their deadline
+        int dropped = 0;
+        if (sv_listen_fd != -1 && FD_ISSET(sv_listen_fd, &read_fds)) {
+            dropped += registrations_accept(&sv_registering, sv_listen_fd);
+        }
+        dropped += registrations_read(&sv_registering, &read_fds);
+        if (dropped > 0) {
+            char bf[96];
+            snprintf(bf, sizeof(bf), "Closed %d server connections that didn't register", dropped);
+            log_msg(bf);
+        }
+        struct ProcessInform reg;
+        int reg_fd;
+        while ((reg_fd = registrations_next(&sv_registering, &reg)) != -1) {
+            register_server(reg_fd, &reg);
+        }
+
+        // check for load balancer messages, a single read may carry a batch of packets
         if (FD_ISSET(lb_fd, &read_fds)) {
-            struct Packet pck;
-            ssize_t bytes_read = read(lb_fd, &pck, sizeof(pck));
+            iobuf_compact(&lb_in);
+            PROF_BEGIN("read_lb");
+            ssize_t bytes_read = read(lb_fd, lb_in.data + lb_in.end, lb_in.cap - lb_in.end);
+            PROF_END();
             
             if (bytes_read == 0) {
                 log_msg("Load balancer disconnected");
                 break;
-            } else if (bytes_read != sizeof(pck)) {
-                perror("read from lb");
+            } else if (bytes_read < 0) {
+                if (errno != EINTR) perror("read from lb");
                 continue;
             }
-            
-            // Find next available server (round-robin)
+            lb_in.end += bytes_read;
 
-            if (sv_sockets[next_sv_idx] != -1) {
-                if (write(sv_sockets[next_sv_idx], &pck, sizeof(pck)) == sizeof(pck)) {
+            PROF_BEGIN("decode");
+            while (lb_in.end - lb_in.start >= sizeof(struct Packet)) {
+                struct Packet pck;
+                memcpy(&pck, lb_in.data + lb_in.start, sizeof(pck));
+                lb_in.start += sizeof(pck);
+                span_stamp(&pck, SPAN_ENTER);
+
+                if (route_proxy_enqueue(&proxy, &pck) < 0) {
                     char msg[128];
-                    snprintf(msg, sizeof(msg), 
-                                "Forwarded client %d to server %d", 
-                                pck.client_id, next_sv_idx);
+                    snprintf(msg, sizeof(msg), "Queue of class %d is full, dropping client %d", 
+                             packet_class(&pck), pck.client_id);
                     log_msg(msg);
                 } else {
-                    // Write failed - server disconnected
-                    close(sv_sockets[next_sv_idx]);
-                    sv_sockets[next_sv_idx] = -1;
+                    span_stamp(&pck, SPAN_QUEUE);
                 }
             }
-            next_sv_idx = (next_sv_idx + 1) % INIT_SV;  
+            PROF_END();
         }
 
+        // Find next available servers (round-robin) for the queued requests
+        flush_servers();
+        rebalance();
+
         // check for server message
-        for (int sv_idx = 0; sv_idx < INIT_SV; sv_idx++) {
+        for (int sv_idx = 0; sv_idx < sv_num; sv_idx++) {
             if (sv_sockets[sv_idx] == -1) continue;
             
             if (FD_ISSET(sv_sockets[sv_idx], &read_fds)) {
-                struct ProcessInform inf;
-                ssize_t bytes_read = read(sv_sockets[sv_idx], &inf, sizeof(inf));
-                
-                if (bytes_read == 0) {
-                    char msg[64];
-                    snprintf(msg, sizeof(msg), "Server %d disconnected", sv_idx);
-                    log_msg(msg);
-                    close(sv_sockets[sv_idx]);
-                    sv_sockets[sv_idx] = -1;
-                } 
-                else if (bytes_read == sizeof(inf)) {
-                    ssize_t bytes_written = write(lb_fd, &inf, sizeof(inf));
-                    if (bytes_written != sizeof(inf)) {
-                        perror("write to lb");
-                    }
-                }
-                else if (bytes_read < 0 && errno != EINTR) {
-                    perror("read from sv");
-                }
-                else {
-                    fprintf(stderr, "Incomplete message from SV %d (%zd/%zu)\n", 
-                            sv_idx, bytes_read, sizeof(inf));
-                }
+                read_sv(sv_idx);
             }
         }
     }
 
+    iobuf_release(&lb_in);
+    for (int sv_idx = 0; sv_idx < sv_num; sv_idx++) {
+        iobuf_release(&sv_in[sv_idx]);
+        iobuf_release(&sv_out[sv_idx]);
+    }
+    span_close();
     return 0;
 }
\ No newline at end of file
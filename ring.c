@@ -0,0 +1,169 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include "ring.h"
+#include "prof.h"
+
+// write everything or fail
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int continue_files = 0; // append to existing files instead of starting them over
+
+// a process taking over from its predecessor keeps adding to the same files, records from the two are
+// whole appends so they never interleave mid-record
+void ring_continue_files(int on) {
+    continue_files = on;
+}
+
+// add the records lost since the last call to the counter in the file header, so a reader knows the file
+// has gaps; the counter accumulates over processes continuing the same file. async-signal-safe
+static void ring_store_dropped(struct RecordRing* r) {
+    unsigned long dropped = atomic_load(&r->dropped);
+    if (r->counter_fd < 0 || dropped == r->dropped_stored) return;
+
+    uint32_t count;
+    if (pread(r->counter_fd, &count, sizeof(count), r->dropped_offset) != sizeof(count)) return;
+    count += dropped - r->dropped_stored;
+    if (pwrite(r->counter_fd, &count, sizeof(count), r->dropped_offset) == sizeof(count)) {
+        r->dropped_stored = dropped;
+    }
+}
+
+static void* ring_writer(void* arg) {
+    struct RecordRing* r = arg;
+    struct timespec idle = {0, 1000000}; // 1 ms
+    PROF_THREAD("ring_writer");
+
+    while (1) {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        if (head == tail) {
+            if (atomic_load(&r->stop)) break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        // flush the contiguous part up to the wrap around point
+        size_t start = tail & (r->cap - 1);
+        size_t count = head - tail;
+        if (start + count > r->cap) count = r->cap - start;
+
+        PROF_BEGIN("write");
+        int err = write_all(r->fd, r->buf + start * r->rec_size, count * r->rec_size);
+        PROF_END();
+        if (err < 0) break;
+        atomic_store_explicit(&r->tail, tail + count, memory_order_release);
+    }
+
+    atomic_store(&r->done, 1);
+    return NULL;
+}
+
+// create the file with the given header and start the writer thread, cap must be a power of two
+// dropped_offset locates a uint32 in the header that counts the records the ring had to drop, -1 for none
+int ring_open(struct RecordRing* r, const char* path, size_t rec_size, size_t cap,
+              const void* header, size_t header_size, long dropped_offset) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->counter_fd = -1;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (continue_files ? 0 : O_TRUNC), 0644);
+    if (fd < 0) return -1;
+    // a continued file already starts with its header
+    if (continue_files && lseek(fd, 0, SEEK_END) > 0) header_size = 0;
+    if (header_size > 0 && write_all(fd, header, header_size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    r->buf = malloc(rec_size * cap);
+    if (r->buf == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (dropped_offset >= 0) {
+        r->counter_fd = open(path, O_RDWR | O_CLOEXEC);
+        r->dropped_offset = dropped_offset;
+    }
+    r->rec_size = rec_size;
+    r->cap = cap;
+    r->fd = fd;
+
+    // the writer thread must never run the signal handlers of the process
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&r->writer, NULL, ring_writer, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        free(r->buf);
+        close(fd);
+        if (r->counter_fd >= 0) close(r->counter_fd);
+        r->counter_fd = -1;
+        r->buf = NULL;
+        r->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// copy a record into the ring, returns -1 (and counts the record as dropped) if the ring is full
+int ring_push(struct RecordRing* r, const void* rec) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head - tail == r->cap) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    memcpy(r->buf + (head & (r->cap - 1)) * r->rec_size, rec, r->rec_size);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// let the writer thread flush what is left and wait (at most a second) for it
+// async-signal-safe, meant for the SIGTERM handlers that _exit right after
+void ring_drain(struct RecordRing* r) {
+    if (r->fd < 0) return;
+
+    atomic_store(&r->stop, 1);
+    struct timespec idle = {0, 1000000}; // 1 ms
+    for (int i = 0; i < 1000 && !atomic_load(&r->done); i++) {
+        nanosleep(&idle, NULL);
+    }
+    ring_store_dropped(r);
+}
+
+// flush, stop the writer thread and release the ring
+void ring_close(struct RecordRing* r) {
+    if (r->fd < 0) return;
+
+    atomic_store(&r->stop, 1);
+    pthread_join(r->writer, NULL);
+    ring_store_dropped(r);
+    if (r->counter_fd >= 0) close(r->counter_fd);
+    r->counter_fd = -1;
+    close(r->fd);
+    free(r->buf);
+    r->buf = NULL;
+    r->fd = -1;
+}
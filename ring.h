@@ -0,0 +1,33 @@
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// single producer, single consumer ring of fixed size records
+// the producer never blocks or takes a lock, a background thread appends the records to a file
+struct RecordRing {
+    char* buf;
+    size_t rec_size;
+    size_t cap; // amount of records, a power of two
+    _Atomic size_t head; // next slot the producer writes
+    _Atomic size_t tail; // next slot the writer thread flushes
+    _Atomic unsigned long dropped; // records lost because the ring was full
+    unsigned long dropped_stored; // part of dropped already added to the file's counter
+    long dropped_offset; // offset of the uint32 drop counter in the file header, -1 if it has none
+    int counter_fd; // positioned writes to the counter, the record fd only appends
+    _Atomic int stop;
+    _Atomic int done;
+    int fd;
+    pthread_t writer;
+};
+
+void ring_continue_files(int on);
+int ring_open(struct RecordRing* r, const char* path, size_t rec_size, size_t cap,
+              const void* header, size_t header_size, long dropped_offset);
+int ring_push(struct RecordRing* r, const void* rec);
+void ring_drain(struct RecordRing* r);
+void ring_close(struct RecordRing* r);
+
+#endif
@@ -0,0 +1,159 @@
+#include "route.h"
+#include "topology.h"
+
+// loads[i] is the work waiting for reverse proxy i, -1 if it can't take requests
+
+// the reverse proxy with the least work, -1 if none (other than the excluded one) is available
+int route_least_loaded(const int* loads, int n, int exclude) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+        if (i == exclude || loads[i] < 0) continue;
+        if (best == -1 || loads[i] < loads[best]) best = i;
+    }
+    return best;
+}
+
+// a client sticks to its proxy unless that one is gone or backed up while another has clearly less work
+int route_choose(int client_id, const int* loads, int n) {
+    int idx = (int)((unsigned)client_id % (unsigned)n); // client ids can be negative
+    if (loads[idx] >= 0 && loads[idx] < STEAL_THRESHOLD) return idx;
+
+    int best = route_least_loaded(loads, n, -1);
+    if (best == -1 || loads[idx] < 0) return best == -1 ? idx : best;
+    return (loads[best] * 2 < loads[idx]) ? best : idx;
+}
+
+// whether a reverse proxy's queue depth moved enough since it was last reported
+int route_should_report(int depth, int reported) {
+    int delta = depth - reported;
+    return delta >= REPORT_DELTA || delta <= -REPORT_DELTA || (depth == 0) != (reported == 0);
+}
+
+void route_proxy_init(struct ProxyQueue* p) {
+    sched_init(&p->queue);
+    p->next_sv_idx = 0;
+    p->reported_depth = 0;
+    p->credits_owed = 0;
+}
+
+// queue a request from the load balancer, a full class drops it and returns its place in the window
+int route_proxy_enqueue(struct ProxyQueue* p, const struct Packet* pck) {
+    if (sched_enqueue(&p->queue, pck) == 0) return 0;
+    p->credits_owed++;
+    return -1;
+}
+
+// hand queued requests in priority order to the servers (round-robin) until none of them can take more
+// returns the amount handed out
+int route_dispatch(struct ProxyQueue* p, int sv_num, route_send_fn send, void* ctx) {
+    int moved = 0;
+    struct Packet* pck;
+    while ((pck = sched_peek(&p->queue)) != NULL) {
+        int sent = 0;
+        for (int tries = 0; tries < sv_num && !sent; tries++) {
+            int sv_idx = p->next_sv_idx;
+            p->next_sv_idx = (p->next_sv_idx + 1) % sv_num;
+            sent = send(ctx, sv_idx, pck) == 0;
+        }
+
+        if (!sent) break;
+        sched_pop(&p->queue);
+        p->credits_owed++;
+        moved++;
+    }
+    return moved;
+}
+
+// hand requests back to the load balancer while backed up, report the queue depth when it moved enough
+// or enough requests left for the window to reopen; returns the amount handed back
+int route_rebalance(struct ProxyQueue* p, int rp_idx, route_up_fn up, void* ctx) {
+    int moved = 0;
+    if (p->queue.pending > PUSHBACK_HIGH) {
+        struct UpMsg msg = { .kind = UP_PUSHBACK };
+        struct Packet pck;
+        while (p->queue.pending > PUSHBACK_LOW && sched_steal(&p->queue, &pck) == 0) {
+            // only the handed back copy is marked, a request that couldn't go stays movable
+            msg.pck = pck;
+            msg.pck.flags |= PACKET_REDIRECTED;
+            if (up(ctx, &msg) < 0) {
+                // a request that can't be put back is lost, its place in the window still has to be returned
+                if (sched_enqueue(&p->queue, &pck) < 0) p->credits_owed++;
+                break;
+            }
+            moved++;
+        }
+    }
+
+    if (route_should_report(p->queue.pending, p->reported_depth) || p->credits_owed >= CREDIT_BATCH) {
+        struct UpMsg msg = { .kind = UP_LOAD, .load = { rp_idx, p->queue.pending, p->credits_owed } };
+        if (up(ctx, &msg) == 0) {
+            p->reported_depth = p->queue.pending;
+            p->credits_owed = 0;
+        }
+    }
+    return moved;
+}
+
+void route_link_init(struct RpLink* l) {
+    sched_init(&l->queue);
+    l->connected = 0;
+    l->reported = 0;
+    l->credits = 0;
+}
+
+// a reverse proxy (re)connected, it starts with an empty queue and a full window
+void route_attach(struct RpLink* l) {
+    l->connected = 1;
+    l->reported = 0;
+    l->credits = RP_WINDOW;
+}
+
+// requests queued for a disconnected reverse proxy wait for it to come back
+void route_detach(struct RpLink* l) {
+    l->connected = 0;
+    l->reported = 0;
+}
+
+// requests waiting for each reverse proxy, in the load balancer's queue or in its own
+void route_loads(const struct RpLink* links, int n, int* loads) {
+    for (int i = 0; i < n; i++) {
+        loads[i] = links[i].connected ? links[i].queue.pending + links[i].reported : -1;
+    }
+}
+
+// send queued requests to the reverse proxy in priority order until its window is used up or it can't take more
+// returns the amount sent
+int route_forward(struct RpLink* l, int rp_idx, route_send_fn send, void* ctx) {
+    int moved = 0;
+    struct Packet* pck;
+    while (l->credits > 0 && (pck = sched_peek(&l->queue)) != NULL && send(ctx, rp_idx, pck) == 0) {
+        l->credits--;
+        sched_pop(&l->queue);
+        moved++;
+    }
+    return moved;
+}
+
+static void add_credits(struct RpLink* l, int credits) {
+    l->credits += credits;
+    if (l->credits > RP_WINDOW) l->credits = RP_WINDOW;
+}
+
+void route_report(struct RpLink* l, const struct LoadReport* load) {
+    l->reported = load->queued;
+    add_credits(l, load->credits);
+}
+
+// queue a request an overloaded reverse proxy handed back for the least loaded other one
+// returns the reverse proxy it was queued for, -1 if that queue is full and it was dropped
+int route_hand_back(struct RpLink* links, int n, int from_idx, const struct Packet* pck) {
+    // a handed back request frees its place in the window
+    add_credits(&links[from_idx], 1);
+
+    int loads[MAX_RP];
+    route_loads(links, n, loads);
+    int rp_idx = route_least_loaded(loads, n, from_idx);
+    if (rp_idx == -1) rp_idx = from_idx;
+
+    return sched_enqueue(&links[rp_idx].queue, pck) == 0 ? rp_idx : -1;
+}
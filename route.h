@@ -0,0 +1,56 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+// routing policy shared by the multi-process daemons and the embedded mode
+// the daemons pass requests over sockets and the embedded mode over lock-free queues, the decisions are made here
+
+#include "protocol.h"
+#include "sched.h"
+
+#define STEAL_THRESHOLD 16 // queued requests above which a client may be sent to a less loaded reverse proxy
+#define REPORT_DELTA 8 // queue depth change a reverse proxy reports to its load balancer
+#define PUSHBACK_HIGH 64 // queued requests above which a reverse proxy hands work back
+#define PUSHBACK_LOW 32 // queue depth the hand back stops at
+#define RP_WINDOW 96 // requests a reverse proxy may hold before the rest waits in the load balancer's queues,
+                     // above PUSHBACK_HIGH so an overloaded proxy still hands work back
+#define CREDIT_BATCH 8 // requests a reverse proxy finishes before it returns them to the window
+
+// a reverse proxy's queue and what its load balancer has heard about it
+struct ProxyQueue {
+    struct Scheduler queue; // requests waiting for a free server, in priority order
+    int next_sv_idx; // round-robin index for server selection
+    int reported_depth; // queue depth the load balancer last heard of
+    int credits_owed; // requests that left the queue since the last report, the load balancer's window reopens by them
+};
+
+// a load balancer's side of one of its reverse proxies
+struct RpLink {
+    struct Scheduler queue; // outbound priority queue
+    int connected;
+    int reported; // queue depth the reverse proxy last reported
+    int credits; // requests the reverse proxy can still take, the rest stays in the queue where priorities apply
+};
+
+// hand a request to server or reverse proxy idx, or a message to the load balancer
+// returns 0 once it is handed over, -1 if it can't be right now
+typedef int (*route_send_fn)(void* ctx, int idx, const struct Packet* pck);
+typedef int (*route_up_fn)(void* ctx, const struct UpMsg* msg);
+
+void route_proxy_init(struct ProxyQueue* p);
+int route_proxy_enqueue(struct ProxyQueue* p, const struct Packet* pck);
+int route_dispatch(struct ProxyQueue* p, int sv_num, route_send_fn send, void* ctx);
+int route_rebalance(struct ProxyQueue* p, int rp_idx, route_up_fn up, void* ctx);
+
+void route_link_init(struct RpLink* l);
+void route_attach(struct RpLink* l);
+void route_detach(struct RpLink* l);
+void route_loads(const struct RpLink* links, int n, int* loads);
+int route_forward(struct RpLink* l, int rp_idx, route_send_fn send, void* ctx);
+void route_report(struct RpLink* l, const struct LoadReport* load);
+int route_hand_back(struct RpLink* links, int n, int from_idx, const struct Packet* pck);
+
+int route_least_loaded(const int* loads, int n, int exclude);
+int route_choose(int client_id, const int* loads, int n);
+int route_should_report(int depth, int reported);
+
+#endif
@@ -0,0 +1,159 @@
+#include <string.h>
+#include "sched.h"
+#include "pool.h"
+#include "prof.h"
+
+// weight of each priority class, indexed by enum Priority
+static const int class_weights[PRIO_COUNT] = { 8, 4, 1 };
+
+// the class of a packet: the explicit priority field if it is valid, otherwise derived from the client id
+int packet_class(const struct Packet* pck) {
+    if (pck->priority >= 0 && pck->priority < PRIO_COUNT) return pck->priority;
+    return (pck->client_id >= 0 && pck->client_id < HIGH_PRIO_CLIENTS) ? PRIO_HIGH : PRIO_NORMAL;
+}
+
+void sched_init(struct Scheduler* s) {
+    memset(s, 0, sizeof(*s));
+    for (int c = 0; c < PRIO_COUNT; c++) {
+        s->classes[c].weight = class_weights[c];
+    }
+    s->classes[0].deficit = s->classes[0].weight;
+}
+
+// returns -1 if the class queue of the packet is full
+int sched_enqueue(struct Scheduler* s, const struct Packet* pck) {
+    PROF_SCOPE("enqueue");
+    struct ClassQueue* q = &s->classes[packet_class(pck)];
+    if (q->len == CLASS_QUEUE_CAP) return -1;
+
+    struct Request* req = pool_alloc(sizeof(*req));
+    if (req == NULL) return -1;
+    req->next = NULL;
+    req->pck = *pck;
+
+    if (q->tail != NULL) {
+        q->tail->next = req;
+    } else {
+        q->head = req;
+    }
+    q->tail = req;
+    q->len++;
+    s->pending++;
+    return 0;
+}
+
+// give the turn to the next class and grant it its quantum
+static void sched_advance(struct Scheduler* s) {
+    s->cur = (s->cur + 1) % PRIO_COUNT;
+    s->classes[s->cur].deficit += s->classes[s->cur].weight;
+}
+
+// the packet that should be sent next, NULL if nothing is queued
+// calling it again without sched_pop returns the same packet
+struct Packet* sched_peek(struct Scheduler* s) {
+    if (s->pending == 0) return NULL;
+
+    while (1) {
+        struct ClassQueue* q = &s->classes[s->cur];
+        if (q->len == 0) {
+            // idle classes don't bank credit
+            q->deficit = 0;
+            sched_advance(s);
+        } else if (q->deficit < 1) {
+            sched_advance(s);
+        } else {
+            return &q->head->pck;
+        }
+    }
+}
+
+// remove the packet returned by the last sched_peek
+void sched_pop(struct Scheduler* s) {
+    struct ClassQueue* q = &s->classes[s->cur];
+    if (q->len == 0) return;
+
+    struct Request* req = q->head;
+    q->head = req->next;
+    if (q->head == NULL) q->tail = NULL;
+    pool_free(req);
+
+    q->len--;
+    q->deficit--;
+    s->pending--;
+}
+
+// take the oldest request of the lowest priority class that wasn't moved before, so it can be handed elsewhere
+// must not be called between sched_peek and sched_pop
+int sched_steal(struct Scheduler* s, struct Packet* out) {
+    for (int c = PRIO_COUNT - 1; c >= 0; c--) {
+        struct ClassQueue* q = &s->classes[c];
+
+        // moved requests stay where they are, the first one that wasn't is unlinked from the list
+        struct Request* prev = NULL;
+        struct Request* req = q->head;
+        while (req != NULL && (req->pck.flags & PACKET_REDIRECTED)) {
+            prev = req;
+            req = req->next;
+        }
+        if (req == NULL) continue;
+
+        *out = req->pck;
+        if (prev != NULL) {
+            prev->next = req->next;
+        } else {
+            q->head = req->next;
+        }
+        if (q->tail == req) q->tail = prev;
+        pool_free(req);
+
+        q->len--;
+        s->pending--;
+        return 0;
+    }
+    return -1;
+}
+
+void rate_init(struct RateLimiter* rl) {
+    memset(rl, 0, sizeof(*rl));
+}
+
+static double seconds_since(const struct timespec* then, const struct timespec* now) {
+    return (now->tv_sec - then->tv_sec) + (now->tv_nsec - then->tv_nsec) / 1e9;
+}
+
+// take a token from the bucket of the client, returns 0 if the client is over its rate
+int rate_allow(struct RateLimiter* rl, int client_id) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // buckets are never emptied again, so a client is found before the first unused one
+    struct TokenBucket* b = NULL;
+    struct TokenBucket* oldest = NULL;
+    unsigned int start = (unsigned int)client_id % RATE_TABLE_SIZE;
+    for (int i = 0; i < RATE_TABLE_SIZE; i++) {
+        struct TokenBucket* cur = &rl->buckets[(start + i) % RATE_TABLE_SIZE];
+        if (!cur->used || cur->client_id == client_id) {
+            b = cur;
+            break;
+        }
+        if (oldest == NULL || seconds_since(&cur->last, &now) > seconds_since(&oldest->last, &now)) oldest = cur;
+    }
+
+    if (b == NULL || !b->used) {
+        // a new client, the table being full gives it the least recently seen bucket
+        if (b == NULL) b = oldest;
+        b->used = 1;
+        b->client_id = client_id;
+        b->tokens = RATE_LIMIT_BURST - 1.0;
+        b->last = now;
+        return 1;
+    }
+
+    b->tokens += seconds_since(&b->last, &now) * RATE_LIMIT_PER_SEC;
+    if (b->tokens > RATE_LIMIT_BURST) b->tokens = RATE_LIMIT_BURST;
+    b->last = now;
+
+    if (b->tokens < 1.0) return 0;
+    b->tokens -= 1.0;
+    return 1;
+}
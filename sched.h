@@ -0,0 +1,58 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <time.h>
+#include "protocol.h"
+
+#define CLASS_QUEUE_CAP 1024 // max queued packets per priority class
+#define HIGH_PRIO_CLIENTS 100 // untagged clients with an id below this are high priority callers
+#define RATE_TABLE_SIZE 1024 // amount of clients tracked by the rate limiter
+#define RATE_LIMIT_PER_SEC 200.0 // token refill rate of each client
+#define RATE_LIMIT_BURST 400.0 // token bucket size of each client
+
+// context of a queued request, allocated from the pool
+struct Request {
+    struct Request* next;
+    struct Packet pck;
+};
+
+// a fifo of requests belonging to one priority class
+struct ClassQueue {
+    struct Request* head;
+    struct Request* tail;
+    int len;
+    int weight; // packets served per deficit round-robin turn
+    int deficit;
+};
+
+// deficit round-robin scheduler over the priority classes
+struct Scheduler {
+    struct ClassQueue classes[PRIO_COUNT];
+    int cur; // class whose turn it currently is
+    int pending; // total queued packets
+};
+
+struct TokenBucket {
+    int used;
+    int client_id;
+    double tokens;
+    struct timespec last;
+};
+
+// per-client token buckets, open addressing on the client id
+struct RateLimiter {
+    struct TokenBucket buckets[RATE_TABLE_SIZE];
+};
+
+int packet_class(const struct Packet* pck);
+
+void sched_init(struct Scheduler* s);
+int sched_enqueue(struct Scheduler* s, const struct Packet* pck);
+struct Packet* sched_peek(struct Scheduler* s);
+void sched_pop(struct Scheduler* s);
+int sched_steal(struct Scheduler* s, struct Packet* out);
+
+void rate_init(struct RateLimiter* rl);
+int rate_allow(struct RateLimiter* rl, int client_id);
+
+#endif
@@ -7,30 +7,27 @@
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
+#include "protocol.h"
+#include "span.h"
+#include "transport.h"
+#include "prof.h"
+#include "busy_poll.h"
+#include "topology.h"
 
 #define SV_LOG_STR "[SERVER %d]: %s\n"
 
-enum ProcessType { LOAD_BALANCER, REVERSE_PROXY, SERVER };
-
-struct ProcessInform {
-    enum ProcessType type;
-    int p_idx;
-    pid_t p_id;
-};
-
-struct Packet {
-    int client_id;
-    float value;
-};
-
 int sv_id;
 int rp_fd;
+struct BusyPoll busy; // spinning before the blocking read, off unless DS_BUSY_POLL_US is set
 
 void log_msg(const char* msg) {
+    PROF_SCOPE("log");
     printf(SV_LOG_STR, sv_id, msg);
 }
 
 void handle_sigterm(int sig) {
+    span_drain();
+    PROF_DUMP();
     const char msg[] = "[SERVER]: Received SIGTERM. Terminating\n";
     write(STDERR_FILENO, msg, sizeof(msg)-1);
     _exit(0);
@@ -39,30 +36,51 @@ void handle_sigterm(int sig) {
 int main(int argc, char* argv[]) {
     // check if the server script was called in the right way
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_id> <socket_fd>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <server_id> <socket_fd | host:port>\n", argv[0]);
         return 1;
     }
 
     // activate sigterm signal handler
     signal(SIGTERM, handle_sigterm);
+    PROF_INIT("server");
 
     sv_id = atoi(argv[1]);
-    rp_fd = atoi(argv[2]);
+    rp_fd = transport_connect(argv[2]);
+    if (rp_fd < 0) {
+        perror("connect to rp");
+        exit(1);
+    }
 
     log_msg("Started");
 
-    struct ProcessInform sv_inf = { SERVER, sv_id, getpid() };
+    struct ProcessInform sv_inf = { SERVER, sv_id, getpid(), placement_pin(SERVER, sv_id) };
     if (write(rp_fd, &sv_inf, sizeof(sv_inf)) != sizeof(sv_inf)) {
         perror("write to rp");
     }
 
+    if (span_open(SERVER, sv_id) < 0) {
+        perror("span_open");
+    }
+
+    busy_poll_init(&busy);
+    if (busy.max_ns > 0) {
+        char bf[64];
+        snprintf(bf, sizeof(bf), "Busy polling up to %lld us", (long long)busy.max_ns / 1000);
+        log_msg(bf);
+    }
+    struct pollfd rp_pfd = { rp_fd, POLLIN, 0 };
+
     while (1) {
         struct Packet pck;
 
-        ssize_t bytes_read = read(rp_fd, &pck, sizeof(pck));
+        // over tcp a packet may arrive split across segments
+        PROF_BEGIN("wait");
+        int spun = busy_poll(&busy, &rp_pfd, 1);
+        ssize_t bytes_read = read_full(rp_fd, &pck, sizeof(pck));
+        if (!spun) busy_poll_woke(&busy);
+        PROF_END();
         
         if (bytes_read < 0) {
-            if (errno == EINTR) continue;  // Interrupted by signal
             perror("read");
             break;
         }
@@ -77,12 +95,22 @@ int main(int argc, char* argv[]) {
             continue;
         }
 
+        span_stamp(&pck, SPAN_ENTER);
+
+        PROF_BEGIN("compute");
+        double root = sqrt(pck.value);
+        PROF_END();
+
         char log_buf[128];
+        PROF_BEGIN("format");
         snprintf(log_buf, sizeof(log_buf), 
                 "Processing client %d, value: %f", 
-                pck.client_id, sqrt(pck.value));
+                pck.client_id, root);
+        PROF_END();
         log_msg(log_buf);
+        span_stamp(&pck, SPAN_COMPLETE);
     }
     
+    span_close();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "span.h"
+#include "ring.h"
+
+static struct RecordRing span_ring;
+static int tracing = 0;
+
+// open <DS_SPAN_DIR>/spans-<type>-<idx>.bin, does nothing if the directory isn't configured
+int span_open(enum ProcessType type, int idx) {
+    const char* dir = getenv(SPAN_DIR_ENV);
+    if (dir == NULL) return 0;
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/spans-%d-%d.bin", dir, type, idx);
+
+    struct SpanHeader header = { SPAN_MAGIC, SPAN_VERSION, sizeof(struct SpanRecord), type, idx, getpid(), 0, 0 };
+    if (ring_open(&span_ring, path, sizeof(struct SpanRecord), SPAN_RING_CAP,
+                  &header, sizeof(header), offsetof(struct SpanHeader, dropped)) < 0) {
+        return -1;
+    }
+    tracing = 1;
+    return 0;
+}
+
+void span_record(const struct Packet* pck, enum SpanKind kind) {
+    if (!tracing) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    struct SpanRecord rec;
+    rec.trace_id = pck->trace_id;
+    rec.ts_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    rec.kind = kind;
+    rec.client_id = pck->client_id;
+    ring_push(&span_ring, &rec);
+}
+
+// async-signal-safe flush for the termination handlers
+void span_drain() {
+    if (tracing) ring_drain(&span_ring);
+}
+
+void span_close() {
+    if (!tracing) return;
+    ring_close(&span_ring);
+    tracing = 0;
+}
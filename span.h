@@ -0,0 +1,45 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+#define SPAN_DIR_ENV "DS_SPAN_DIR" // directory the span files are written to, tracing is off if unset
+#define SPAN_SAMPLE_ENV "LB_TRACE_SAMPLE" // the load balancer samples one in this many requests
+#define SPAN_MAGIC 0x4e415053u // "SPAN"
+#define SPAN_VERSION 2
+#define SPAN_RING_CAP 16384 // spans buffered between a process and its writer thread
+
+// the points of a request's life that are stamped in every process it passes
+enum SpanKind { SPAN_ENTER, SPAN_QUEUE, SPAN_DISPATCH, SPAN_COMPLETE };
+
+// each process writes its own file, the header says which process it is
+struct SpanHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t proc_type; // enum ProcessType
+    int32_t proc_idx;
+    int32_t pid;
+    uint32_t dropped; // spans that didn't make it into the file, kept up to date by the recorder
+    uint32_t reserved;
+};
+
+struct SpanRecord {
+    uint64_t trace_id;
+    uint64_t ts_ns; // CLOCK_MONOTONIC
+    uint32_t kind; // enum SpanKind
+    int32_t client_id;
+};
+
+int span_open(enum ProcessType type, int idx);
+void span_record(const struct Packet* pck, enum SpanKind kind);
+void span_drain();
+void span_close();
+
+// stamp a span, a single branch for requests that aren't sampled
+static inline void span_stamp(const struct Packet* pck, enum SpanKind kind) {
+    if (__builtin_expect(pck->flags & PACKET_SAMPLED, 0)) span_record(pck, kind);
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "span.h"
+
+struct Event {
+    uint64_t trace_id;
+    uint64_t ts_ns;
+    uint32_t kind;
+    int32_t client_id;
+    int file; // index of the span file (and so the process) the event came from
+};
+
+struct Event* events = NULL;
+size_t event_count = 0;
+size_t event_cap = 0;
+uint64_t base_ns; // earliest timestamp, the zero of the viewer's time axis
+
+const char* process_to_string(enum ProcessType type) {
+    switch (type)
+    {
+        case LOAD_BALANCER:
+            return "Load Balancer";
+        case REVERSE_PROXY:
+            return "Reverse Proxy";
+        case SERVER:
+            return "Server";
+        default:
+            return "Unknown process";
+    }
+}
+
+// name of the slice between two consecutive events of a request inside one process
+const char* slice_name(uint32_t from, uint32_t to) {
+    if (from == SPAN_ENTER && to == SPAN_QUEUE) return "admit";
+    if (from == SPAN_QUEUE && to == SPAN_DISPATCH) return "queued";
+    if (from == SPAN_ENTER && to == SPAN_DISPATCH) return "forward";
+    if (from == SPAN_DISPATCH && to == SPAN_DISPATCH) return "retry";
+    if (to == SPAN_COMPLETE) return "process";
+    return "span";
+}
+
+int compare_events(const void* a, const void* b) {
+    const struct Event* ea = a;
+    const struct Event* eb = b;
+    if (ea->trace_id != eb->trace_id) return ea->trace_id < eb->trace_id ? -1 : 1;
+    if (ea->ts_ns != eb->ts_ns) return ea->ts_ns < eb->ts_ns ? -1 : 1;
+    return ea->kind < eb->kind ? -1 : (ea->kind > eb->kind);
+}
+
+// a complete event on the row of the request, shown in the process the slice ends in
+void write_slice(FILE* out, const struct SpanHeader* headers, const char* name,
+                 const struct Event* a, const struct Event* b) {
+    fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"args\":{\"trace_id\":\"%llx\",\"client_id\":%d}}",
+            name, headers[b->file].pid, (unsigned long long)a->trace_id,
+            (a->ts_ns - base_ns) / 1e3, (b->ts_ns - a->ts_ns) / 1e3,
+            (unsigned long long)a->trace_id, a->client_id);
+}
+
+int load_file(const char* path, int file_idx, struct SpanHeader* header) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(header, sizeof(*header), 1, fp) != 1 || header->magic != SPAN_MAGIC ||
+        header->version != SPAN_VERSION || header->record_size != sizeof(struct SpanRecord)) {
+        fprintf(stderr, "%s: not a span file or unsupported version\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (header->dropped > 0) {
+        fprintf(stderr, "%s: warning, %u spans were lost, some timelines are incomplete\n", path, header->dropped);
+    }
+
+    struct SpanRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (event_count == event_cap) {
+            event_cap = event_cap ? event_cap * 2 : 4096;
+            events = realloc(events, event_cap * sizeof(*events));
+            if (events == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        struct Event* e = &events[event_count++];
+        e->trace_id = rec.trace_id;
+        e->ts_ns = rec.ts_ns;
+        e->kind = rec.kind;
+        e->client_id = rec.client_id;
+        e->file = file_idx;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // check if the stitch script was called in the right way
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output.json> <span_file>...\n", argv[0]);
+        return 1;
+    }
+
+    int file_count = argc - 2;
+    struct SpanHeader* headers = calloc(file_count, sizeof(*headers));
+    for (int i = 0; i < file_count; i++) {
+        if (load_file(argv[i + 2], i, &headers[i]) < 0) return 1;
+    }
+    if (event_count == 0) {
+        fprintf(stderr, "No spans found\n");
+        return 1;
+    }
+
+    qsort(events, event_count, sizeof(*events), compare_events);
+
+    base_ns = events[0].ts_ns;
+    for (size_t i = 1; i < event_count; i++) {
+        if (events[i].ts_ns < base_ns) base_ns = events[i].ts_ns;
+    }
+
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // chrome trace format: one viewer process per daemon, one row per request
+    fprintf(out, "{\"traceEvents\":[\n");
+    int first = 1;
+    for (int i = 0; i < file_count; i++) {
+        fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first ? "" : ",\n", headers[i].pid, process_to_string(headers[i].proc_type), headers[i].proc_idx);
+        first = 0;
+    }
+
+    size_t traces = 0;
+    for (size_t start = 0; start < event_count; ) {
+        size_t end = start;
+        while (end < event_count && events[end].trace_id == events[start].trace_id) end++;
+        traces++;
+
+        // consecutive events of a process make a slice, a dispatch followed by another process' enter is a hop
+        int hops = 0;
+        for (size_t i = start; i < end; i++) {
+            const struct Event* a = &events[i];
+
+            for (size_t j = i + 1; j < end; j++) {
+                if (events[j].file != a->file) continue;
+                write_slice(out, headers, slice_name(a->kind, events[j].kind), a, &events[j]);
+                break;
+            }
+
+            if (a->kind != SPAN_ENTER) continue;
+            const struct Event* from = NULL;
+            for (size_t j = start; j < i; j++) {
+                if (events[j].kind == SPAN_DISPATCH && events[j].file != a->file) from = &events[j];
+            }
+            if (from != NULL) {
+                write_slice(out, headers, "transit", from, a);
+                hops++;
+            }
+        }
+
+        printf("trace %llx client %d: %.1f us end to end, %d hops, %zu spans\n",
+               (unsigned long long)events[start].trace_id, events[start].client_id,
+               (events[end - 1].ts_ns - events[start].ts_ns) / 1e3, hops, end - start);
+        start = end;
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    printf("Wrote %zu traces to %s\n", traces, argv[1]);
+    free(headers);
+    free(events);
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include "sched.h"
+#include "route.h"
+
+// checks of the scheduler, its rate limiter and the hand back of a reverse proxy, run with `make test`
+
+static struct RateLimiter rl;
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok) failures++;
+}
+
+// requests allowed out of a burst of n from one client
+static int burst(int client_id, int n) {
+    int allowed = 0;
+    for (int i = 0; i < n; i++) allowed += rate_allow(&rl, client_id);
+    return allowed;
+}
+
+static struct Packet packet(int client_id, int priority, int flags) {
+    struct Packet pck = {0};
+    pck.client_id = client_id;
+    pck.priority = priority;
+    pck.flags = flags;
+    return pck;
+}
+
+// pop n requests and return their classes in order
+static void serve(struct Scheduler* s, int n, int* classes) {
+    for (int i = 0; i < n; i++) {
+        struct Packet* pck = sched_peek(s);
+        classes[i] = pck != NULL ? packet_class(pck) : -1;
+        sched_pop(s);
+    }
+}
+
+// with every class backed up the turns go 8 high, 4 normal, 1 low
+static void check_weights() {
+    struct Scheduler s;
+    sched_init(&s);
+    for (int c = 0; c < PRIO_COUNT; c++) {
+        for (int i = 0; i < 200; i++) {
+            struct Packet pck = packet(i, c, 0);
+            sched_enqueue(&s, &pck);
+        }
+    }
+
+    int classes[130];
+    serve(&s, 130, classes);
+    int ok = 1;
+    for (int i = 0; i < 13; i++) {
+        int expected = i < 8 ? PRIO_HIGH : i < 12 ? PRIO_NORMAL : PRIO_LOW;
+        ok = ok && classes[i] == expected;
+    }
+    check(ok, "a round serves 8 high, then 4 normal, then 1 low");
+
+    int served[PRIO_COUNT] = {0};
+    for (int i = 0; i < 130; i++) {
+        if (classes[i] >= 0) served[classes[i]]++;
+    }
+    check(served[PRIO_HIGH] == 80 && served[PRIO_NORMAL] == 40 && served[PRIO_LOW] == 10,
+          "ten rounds keep the 8:4:1 share");
+}
+
+// a class that had nothing queued gets its quantum when it shows up, not what it missed
+static void check_idle_credit() {
+    struct Scheduler s;
+    sched_init(&s);
+    for (int i = 0; i < 100; i++) {
+        struct Packet pck = packet(i, PRIO_LOW, 0);
+        sched_enqueue(&s, &pck);
+    }
+    int classes[100];
+    serve(&s, 50, classes);
+
+    for (int i = 0; i < 100; i++) {
+        struct Packet pck = packet(i, PRIO_HIGH, 0);
+        sched_enqueue(&s, &pck);
+    }
+    serve(&s, 100, classes);
+    int run = 0, longest = 0, low = 0;
+    for (int i = 0; i < 100; i++) {
+        run = classes[i] == PRIO_HIGH ? run + 1 : 0;
+        if (run > longest) longest = run;
+        low += classes[i] == PRIO_LOW;
+    }
+    check(longest <= 8 && low >= 10, "an idle class doesn't bank credit");
+}
+
+// peek keeps returning the packet pop removes, whatever class it is in
+static void check_peek_pop() {
+    struct Scheduler s;
+    sched_init(&s);
+    int total = 0;
+    for (int i = 0; i < 60; i++) {
+        struct Packet pck = packet(i, i % PRIO_COUNT, 0);
+        total += sched_enqueue(&s, &pck) == 0;
+    }
+
+    int seen[60] = {0};
+    int ok = total == 60;
+    for (int i = 0; i < total; i++) {
+        struct Packet* first = sched_peek(&s);
+        struct Packet* again = sched_peek(&s);
+        if (first == NULL || first != again) {
+            ok = 0;
+            break;
+        }
+        int id = first->client_id;
+        sched_pop(&s);
+        ok = ok && id >= 0 && id < 60 && !seen[id] && s.pending == total - i - 1;
+        if (id >= 0 && id < 60) seen[id] = 1;
+
+        // in each class the packets leave in the order they came
+        for (int prev = id - PRIO_COUNT; prev >= 0; prev -= PRIO_COUNT) {
+            ok = ok && seen[prev];
+        }
+    }
+    check(ok, "peek and pop agree across classes and serve each packet once");
+    check(sched_peek(&s) == NULL && s.pending == 0, "an empty scheduler has nothing to peek");
+}
+
+// a moved request at the head of a class must not hide the unmoved ones behind it
+static void check_steal() {
+    struct Scheduler s;
+    sched_init(&s);
+    struct Packet pck = packet(0, PRIO_LOW, PACKET_REDIRECTED);
+    sched_enqueue(&s, &pck);
+    for (int i = 1; i <= 10; i++) {
+        pck = packet(i, PRIO_LOW, 0);
+        sched_enqueue(&s, &pck);
+    }
+    pck = packet(100, PRIO_HIGH, 0);
+    sched_enqueue(&s, &pck);
+
+    struct Packet stolen;
+    check(sched_steal(&s, &stolen) == 0 && stolen.client_id == 1, "steal skips a moved request at the head");
+
+    int ok = 1;
+    for (int i = 2; i <= 10; i++) {
+        ok = ok && sched_steal(&s, &stolen) == 0 && stolen.client_id == i;
+    }
+    check(ok, "steal takes the rest of the class in order");
+    check(sched_steal(&s, &stolen) == 0 && stolen.client_id == 100, "steal reaches a higher class only after that");
+    check(sched_steal(&s, &stolen) == -1 && s.pending == 1, "the moved request is never stolen");
+
+    // the class is still a well formed fifo after unlinking from the middle
+    pck = packet(11, PRIO_LOW, 0);
+    sched_enqueue(&s, &pck);
+    struct Packet* first = sched_peek(&s);
+    int first_id = first != NULL ? first->client_id : -1;
+    sched_pop(&s);
+    struct Packet* second = sched_peek(&s);
+    check(first_id == 0 && second != NULL && second->client_id == 11 && s.pending == 1,
+          "a class keeps its order after a steal from the middle");
+    sched_pop(&s);
+}
+
+static int up_sent = 0;
+static int up_flagged = 0;
+
+static int up_fails(void* ctx, const struct UpMsg* msg) {
+    return -1;
+}
+
+static int up_counts(void* ctx, const struct UpMsg* msg) {
+    if (msg->kind == UP_PUSHBACK) {
+        up_sent++;
+        up_flagged += (msg->pck.flags & PACKET_REDIRECTED) != 0;
+    }
+    return 0;
+}
+
+// a request is only marked as moved once it was actually handed back
+static void check_hand_back() {
+    struct ProxyQueue p;
+    route_proxy_init(&p);
+    for (int i = 0; i <= PUSHBACK_HIGH; i++) {
+        struct Packet pck = packet(i, PRIO_LOW, 0);
+        route_proxy_enqueue(&p, &pck);
+    }
+
+    check(route_rebalance(&p, 0, up_fails, NULL) == 0 && p.queue.pending == PUSHBACK_HIGH + 1,
+          "a hand back that can't be sent keeps the request");
+    int moved = route_rebalance(&p, 0, up_counts, NULL);
+    check(moved == PUSHBACK_HIGH + 1 - PUSHBACK_LOW && up_sent == moved && up_flagged == moved,
+          "the kept request is handed back marked on the next try");
+
+    struct Packet stolen;
+    int unmarked = 0;
+    while (sched_steal(&p.queue, &stolen) == 0) unmarked++;
+    check(unmarked == PUSHBACK_LOW && p.queue.pending == 0, "the requests that stay aren't marked");
+}
+
+int main() {
+    check_weights();
+    check_idle_credit();
+    check_peek_pop();
+    check_steal();
+    check_hand_back();
+
+    rate_init(&rl);
+    int limit = (int)RATE_LIMIT_BURST;
+
+    check(burst(1, limit + 100) <= limit + 1, "a client is limited to its burst");
+    check(burst(-7, limit + 100) <= limit + 1, "a negative client id is limited too");
+
+    // more clients than the table tracks, each seen once
+    for (int id = 1000; id < 1000 + 3 * RATE_TABLE_SIZE; id++) rate_allow(&rl, id);
+
+    check(burst(1000000, limit + 100) <= limit + 1, "a new client is limited once the table has been filled");
+    check(burst(2000000, limit + 100) <= limit + 1, "and so is the one after it");
+    check(burst(1000000, 10) <= 1, "a limited client stays limited while others come and go");
+
+    return failures > 0;
+}
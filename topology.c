@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "topology.h"
+
+#define MAX_DOMAINS 64
+
+// the plan's cpus grouped by the l3 cache (or numa node) they share, domain d holds cpus[start[d]..start[d+1])
+struct Domains {
+    int count;
+    int start[MAX_DOMAINS + 1];
+    int cpus[CPU_SETSIZE];
+};
+
+// the amount in the variable, "auto" sizes the tier from the cores
+static int env_amount(const char* name, int def, int max) {
+    const char* str = getenv(name);
+    int amount = def;
+    if (str != NULL && strcmp(str, "auto") == 0) {
+        int rps, svs;
+        topology_auto_size(&rps, &svs);
+        amount = strcmp(name, RP_AMOUNT_ENV) == 0 ? rps : svs;
+    } else if (str != NULL) {
+        amount = atoi(str);
+    }
+    if (amount < 1) return 1;
+    return amount > max ? max : amount;
+}
+
+int rp_amount() {
+    return env_amount(RP_AMOUNT_ENV, DEFAULT_RP_AMOUNT, MAX_RP);
+}
+
+int sv_amount() {
+    return env_amount(SV_AMOUNT_ENV, DEFAULT_SV_AMOUNT, MAX_SV);
+}
+
+// "0-3,6" into a cpu set, returns the amount of cpus
+static int parse_cpulist(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0) CPU_SET(cpu, set);
+        }
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    return CPU_COUNT(set);
+}
+
+static void format_cpulist(const cpu_set_t* set, char* buf, size_t len) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < len; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        int n = last > cpu ? snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", cpu, last)
+                           : snprintf(buf + used, len - used, "%s%d", used ? "," : "", cpu);
+        if (n < 0) break;
+        used += n;
+        cpu = last;
+    }
+}
+
+static int read_line(const char* path, char* buf, size_t len) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char* line = fgets(buf, len, f);
+    fclose(f);
+    if (line == NULL) return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+// cpus the plan is made over: the watchdog's list, else our own affinity
+static void plan_cpus(cpu_set_t* set) {
+    const char* list = getenv(CPUS_ENV);
+    if (list != NULL && parse_cpulist(list, set) > 0) return;
+    if (sched_getaffinity(0, sizeof(*set), set) < 0) {
+        CPU_ZERO(set);
+        CPU_SET(0, set);
+    }
+}
+
+// cpus with the same key share a domain: the first cpu of their l3 cache, else their numa node
+static int domain_key(int cpu) {
+    char path[128], buf[256];
+    for (int index = 0; index < 8; index++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        if (read_line(path, buf, sizeof(buf)) < 0) break;
+        if (atoi(buf) != 3) continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        if (read_line(path, buf, sizeof(buf)) == 0) return atoi(buf);
+    }
+
+    for (int node = 0; node < MAX_DOMAINS; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_line(path, buf, sizeof(buf)) < 0) continue;
+        cpu_set_t set;
+        if (parse_cpulist(buf, &set) > 0 && CPU_ISSET(cpu, &set)) return CPU_SETSIZE + node;
+    }
+    return 0;
+}
+
+static void load_domains(struct Domains* dom) {
+    cpu_set_t set;
+    plan_cpus(&set);
+
+    int keys[CPU_SETSIZE], cpus[CPU_SETSIZE], n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        cpus[n] = cpu;
+        keys[n++] = domain_key(cpu);
+    }
+
+    // group by key in the order the keys first appear, domains beyond the limit are left out
+    int placed = 0;
+    dom->count = 0;
+    for (int i = 0; i < n && dom->count < MAX_DOMAINS; i++) {
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = keys[j] == keys[i];
+        if (seen) continue;
+
+        dom->start[dom->count++] = placed;
+        for (int j = i; j < n; j++) {
+            if (keys[j] == keys[i]) dom->cpus[placed++] = cpus[j];
+        }
+    }
+    dom->start[dom->count] = placed;
+}
+
+// interrupts served by each cpu so far, -1 if /proc/interrupts can't be read
+static int irq_counts(unsigned long long* counts) {
+    FILE* f = fopen("/proc/interrupts", "r");
+    if (f == NULL) return -1;
+
+    char* line = NULL;
+    size_t cap = 0;
+    int columns[CPU_SETSIZE], ncols = 0;
+    memset(counts, 0, sizeof(*counts) * CPU_SETSIZE);
+
+    // the header names the cpu of every column: "CPU0 CPU1 ..."
+    if (getline(&line, &cap, f) > 0) {
+        char* p = line;
+        while ((p = strstr(p, "CPU")) != NULL && ncols < CPU_SETSIZE) {
+            int cpu = atoi(p + 3);
+            columns[ncols++] = cpu < CPU_SETSIZE ? cpu : 0;
+            p += 3;
+        }
+    }
+
+    while (getline(&line, &cap, f) > 0) {
+        char* p = strchr(line, ':');
+        if (p == NULL) continue;
+        p++;
+        for (int col = 0; col < ncols; col++) {
+            char* end;
+            unsigned long long v = strtoull(p, &end, 10);
+            if (end == p) break;
+            counts[columns[col]] += v;
+            p = end;
+        }
+    }
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+// keep the cpus busiest with interrupts out of the plan, but never more than half of them
+static void drop_irq_heavy(cpu_set_t* set, cpu_set_t* reserved) {
+    unsigned long long counts[CPU_SETSIZE];
+    int total = CPU_COUNT(set);
+    if (total <= 2 || irq_counts(counts) < 0) return;
+
+    unsigned long long sum = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set)) sum += counts[cpu];
+    }
+    unsigned long long mean = sum / total;
+
+    int left = total;
+    for (int cpu = 0; cpu < CPU_SETSIZE && left > total / 2; cpu++) {
+        if (CPU_ISSET(cpu, set) && mean > 0 && counts[cpu] > IRQ_HEAVY_FACTOR * mean) {
+            CPU_CLR(cpu, set);
+            CPU_SET(cpu, reserved);
+            left--;
+        }
+    }
+}
+
+// settle the cpus the whole tree plans over and export them for the children, returns their amount
+// an explicit DS_CPUS is kept as is; otherwise our affinity minus DS_RESERVED_CPUS or the irq heavy cpus
+int topology_export(char* summary, size_t len) {
+    cpu_set_t set, reserved;
+    CPU_ZERO(&reserved);
+
+    if (getenv(CPUS_ENV) == NULL || parse_cpulist(getenv(CPUS_ENV), &set) == 0) {
+        plan_cpus(&set);
+        const char* list = getenv(RESERVED_CPUS_ENV);
+        if (list != NULL) {
+            parse_cpulist(list, &reserved);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &reserved) && CPU_COUNT(&set) > 1) CPU_CLR(cpu, &set);
+            }
+        } else {
+            drop_irq_heavy(&set, &reserved);
+        }
+
+        char cpus[512];
+        format_cpulist(&set, cpus, sizeof(cpus));
+        setenv(CPUS_ENV, cpus, 1);
+    }
+
+    if (summary != NULL) {
+        char cpus[256], kept[256];
+        format_cpulist(&set, cpus, sizeof(cpus));
+        format_cpulist(&reserved, kept, sizeof(kept));
+        snprintf(summary, len, "cpus %s%s%s", cpus, CPU_COUNT(&reserved) ? ", reserved " : "", kept);
+    }
+    return CPU_COUNT(&set);
+}
+
+// one reverse proxy per AUTO_CPUS_PER_RP cpus of each domain (at least one), its servers fill the rest
+void topology_auto_size(int* rps, int* svs) {
+    struct Domains dom;
+    load_domains(&dom);
+
+    // the first domain also hosts the load balancer
+    int per_domain = CPU_SETSIZE;
+    for (int d = 0; d < dom.count; d++) {
+        int size = dom.start[d + 1] - dom.start[d] - (d == 0);
+        if (size < per_domain) per_domain = size;
+    }
+    if (dom.count == 0) per_domain = 1;
+
+    int rps_per_domain = per_domain / AUTO_CPUS_PER_RP > 0 ? per_domain / AUTO_CPUS_PER_RP : 1;
+    int total = (dom.count > 0 ? dom.count : 1) * rps_per_domain;
+    *rps = total < MAX_RP ? total : MAX_RP;
+
+    int servers = per_domain / rps_per_domain - 1;
+    *svs = servers < 1 ? 1 : (servers > MAX_SV ? MAX_SV : servers);
+}
+
+// the cpu of a process: reverse proxies are dealt round-robin over the domains and their servers follow them
+// into the same domain, the load balancer takes the first cpu of the first domain
+// a domain with more processes than cpus wraps around and shares them
+int placement_cpu(enum ProcessType type, int idx) {
+    struct Domains dom;
+    load_domains(&dom);
+    if (dom.count == 0) return -1;
+
+    int svs = sv_amount();
+    int rp = type == SERVER ? idx / svs : idx;
+    int d = type == LOAD_BALANCER ? idx % dom.count : rp % dom.count;
+
+    int slot = 0;
+    if (type != LOAD_BALANCER) {
+        slot = (d == 0) + (rp / dom.count) * (1 + svs);
+        if (type == SERVER) slot += 1 + idx % svs;
+    }
+
+    int size = dom.start[d + 1] - dom.start[d];
+    return dom.cpus[dom.start[d] + slot % size];
+}
+
+// pin the calling thread to its cpu when DS_PIN is set, returns the cpu or -1 if it isn't pinned
+int placement_pin(enum ProcessType type, int idx) {
+    const char* pin = getenv(PIN_ENV);
+    if (pin == NULL || atoi(pin) == 0) return -1;
+
+    // our children inherit the pinned affinity, they must still plan over the whole set
+    if (getenv(CPUS_ENV) == NULL) topology_export(NULL, 0);
+
+    int cpu = placement_cpu(type, idx);
+    if (cpu < 0) return -1;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return cpu;
+}
@@ -0,0 +1,29 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+// cluster sizing and cpu placement, read from the environment the watchdog sets up for its tree
+
+#define RP_AMOUNT_ENV "DS_RP_AMOUNT" // reverse proxies per load balancer
+#define SV_AMOUNT_ENV "DS_SV_AMOUNT" // servers per reverse proxy
+#define PIN_ENV "DS_PIN" // 1 pins every process to the cpu the placement plan gives it
+#define CPUS_ENV "DS_CPUS" // cpus the plan is made over, e.g. "0-3,6", the process's own affinity by default
+#define RESERVED_CPUS_ENV "DS_RESERVED_CPUS" // cpus the watchdog keeps out of DS_CPUS, its busiest irq cpus by default
+#define DEFAULT_RP_AMOUNT 2
+#define DEFAULT_SV_AMOUNT 3
+#define MAX_RP 16
+#define MAX_SV 16
+#define AUTO_CPUS_PER_RP 4 // automatic sizing gives a reverse proxy and its servers this many cpus
+#define IRQ_HEAVY_FACTOR 2 // a cpu with this many times the average interrupt count is kept free
+
+int rp_amount();
+int sv_amount();
+void topology_auto_size(int* rps, int* svs);
+int topology_export(char* summary, size_t len);
+
+int placement_cpu(enum ProcessType type, int idx);
+int placement_pin(enum ProcessType type, int idx);
+
+#endif
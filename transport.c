@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "transport.h"
+
+enum TransportKind transport_kind() {
+    const char* kind = getenv(TRANSPORT_ENV);
+    return (kind != NULL && strcmp(kind, "tcp") == 0) ? TRANSPORT_TCP : TRANSPORT_UNIX;
+}
+
+// whether a tcp parent forks its children itself or waits for them to register from elsewhere
+int transport_spawn_local() {
+    const char* spawn = getenv(SPAWN_LOCAL_ENV);
+    return spawn == NULL || atoi(spawn) != 0;
+}
+
+// the port the given process listens on for its children
+int transport_port(enum ProcessType type, int idx) {
+    const char* base_str = getenv(TCP_PORT_ENV);
+    int base = base_str != NULL ? atoi(base_str) : DEFAULT_TCP_PORT;
+    return type == LOAD_BALANCER ? base + idx : base + RP_PORT_OFFSET + idx;
+}
+
+// "host:port" a locally spawned child connects to
+void transport_endpoint(char* buf, size_t len, int port) {
+    const char* host = getenv(TCP_HOST_ENV);
+    snprintf(buf, len, "%s:%d", host != NULL ? host : DEFAULT_TCP_HOST, port);
+}
+
+static void set_nodelay(int fd) {
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+    }
+}
+
+// listening socket on all interfaces so children on other nodes can register
+int transport_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int transport_accept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) return -1;
+    set_nodelay(fd);
+    return fd;
+}
+
+// an endpoint is either an inherited descriptor ("5") or the parent's address ("host:port")
+int transport_connect(const char* endpoint) {
+    const char* p = endpoint;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == '\0' && p != endpoint) return atoi(endpoint);
+
+    const char* colon = strrchr(endpoint, ':');
+    if (colon == NULL || colon == endpoint) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char host[256];
+    size_t host_len = colon - endpoint;
+    if (host_len >= sizeof(host)) host_len = sizeof(host) - 1;
+    memcpy(host, endpoint, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    struct timespec retry = {0, 100000000}; // 100 ms
+    for (int attempt = 0; attempt < CONNECT_RETRIES && fd < 0; attempt++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) break;
+        if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+            nanosleep(&retry, NULL);
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) set_nodelay(fd);
+    return fd;
+}
+
+// read exactly len bytes unless the peer closes first, returns the amount read or -1
+ssize_t read_full(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+void registrations_init(struct Registrations* r, size_t msg_size) {
+    r->msg_size = msg_size;
+    for (int i = 0; i < MAX_REGISTERING; i++) {
+        r->conns[i].fd = -1;
+    }
+}
+
+static long long ms_until(const struct timespec* deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000ll + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+// accept a child and wait for its registration, when every slot is taken the oldest one is given up
+// returns the amount of connections closed to make room
+int registrations_accept(struct Registrations* r, int listen_fd) {
+    int fd = transport_accept(listen_fd);
+    if (fd < 0) return 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    int slot = -1, closed = 0;
+    for (int i = 0; i < MAX_REGISTERING && slot == -1; i++) {
+        if (r->conns[i].fd == -1) slot = i;
+    }
+    if (slot == -1) {
+        slot = 0;
+        for (int i = 1; i < MAX_REGISTERING; i++) {
+            if (ms_until(&r->conns[i].deadline) < ms_until(&r->conns[slot].deadline)) slot = i;
+        }
+        close(r->conns[slot].fd);
+        closed = 1;
+    }
+
+    struct PendingConn* c = &r->conns[slot];
+    c->fd = fd;
+    c->len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+    c->deadline.tv_sec += REGISTER_TIMEOUT_MS / 1000;
+    c->deadline.tv_nsec += (REGISTER_TIMEOUT_MS % 1000) * 1000000l;
+    if (c->deadline.tv_nsec >= 1000000000l) {
+        c->deadline.tv_sec++;
+        c->deadline.tv_nsec -= 1000000000l;
+    }
+    return closed;
+}
+
+// add the pending connections to the read set and shorten the select timeout to the nearest deadline,
+// a negative tv_sec stands for no timeout; returns the new max fd
+int registrations_watch(struct Registrations* r, fd_set* read_fds, int max_fd, struct timeval* timeout) {
+    long long nearest = -1;
+    for (int i = 0; i < MAX_REGISTERING; i++) {
+        struct PendingConn* c = &r->conns[i];
+        if (c->fd == -1) continue;
+
+        FD_SET(c->fd, read_fds);
+        if (c->fd > max_fd) max_fd = c->fd;
+        long long ms = ms_until(&c->deadline);
+        if (nearest == -1 || ms < nearest) nearest = ms < 0 ? 0 : ms;
+    }
+
+    if (nearest >= 0) {
+        long long current = timeout->tv_sec * 1000ll + timeout->tv_usec / 1000;
+        if (timeout->tv_sec < 0 || nearest < current) {
+            timeout->tv_sec = nearest / 1000;
+            timeout->tv_usec = (nearest % 1000) * 1000;
+        }
+    }
+    return max_fd;
+}
+
+// read what arrived on the pending connections, closes the ones that hung up or missed their deadline
+// returns the amount closed
+int registrations_read(struct Registrations* r, fd_set* read_fds) {
+    int closed = 0;
+    for (int i = 0; i < MAX_REGISTERING; i++) {
+        struct PendingConn* c = &r->conns[i];
+        if (c->fd == -1 || c->len == r->msg_size) continue;
+
+        int failed = 0;
+        if (FD_ISSET(c->fd, read_fds)) {
+            ssize_t n = read(c->fd, c->buf + c->len, r->msg_size - c->len);
+            if (n > 0) c->len += n;
+            failed = n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        if (failed || (c->len < r->msg_size && ms_until(&c->deadline) <= 0)) {
+            close(c->fd);
+            c->fd = -1;
+            closed++;
+        }
+    }
+    return closed;
+}
+
+// hand out a connection that has sent its whole registration, the message is copied to msg
+// returns its descriptor (blocking again) or -1 if none is complete
+int registrations_next(struct Registrations* r, void* msg) {
+    for (int i = 0; i < MAX_REGISTERING; i++) {
+        struct PendingConn* c = &r->conns[i];
+        if (c->fd == -1 || c->len < r->msg_size) continue;
+
+        int fd = c->fd;
+        c->fd = -1;
+        memcpy(msg, c->buf, r->msg_size);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return fd;
+    }
+    return -1;
+}
@@ -0,0 +1,54 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include "protocol.h"
+
+#define TRANSPORT_ENV "DS_TRANSPORT" // "unix" (default, socketpairs) or "tcp"
+#define TCP_HOST_ENV "DS_TCP_HOST" // address locally spawned children connect to, 127.0.0.1 by default
+#define TCP_PORT_ENV "DS_TCP_PORT" // base of the listening ports, load balancer n uses base + n
+#define SPAWN_LOCAL_ENV "DS_SPAWN_LOCAL" // set to 0 to wait for children started on other nodes
+#define DEFAULT_TCP_HOST "127.0.0.1"
+#define DEFAULT_TCP_PORT 7100
+#define RP_PORT_OFFSET 100 // reverse proxy n listens on base + 100 + n
+#define CONNECT_RETRIES 50 // attempts (100 ms apart) to reach a parent that isn't listening yet
+#define MAX_REGISTERING 8 // accepted connections waiting for their registration message
+#define REGISTER_TIMEOUT_MS 2000 // a connection that hasn't registered by then is closed
+
+enum TransportKind { TRANSPORT_UNIX, TRANSPORT_TCP };
+
+// an accepted connection whose registration message hasn't fully arrived
+struct PendingConn {
+    int fd; // -1 if the slot is free
+    size_t len;
+    char buf[sizeof(struct UpMsg)];
+    struct timespec deadline;
+};
+
+// children registering on a listening socket, read without blocking so a silent peer can't stall the loop
+struct Registrations {
+    size_t msg_size; // the first message a child sends, at most sizeof(struct UpMsg)
+    struct PendingConn conns[MAX_REGISTERING];
+};
+
+enum TransportKind transport_kind();
+int transport_spawn_local();
+int transport_port(enum ProcessType type, int idx);
+void transport_endpoint(char* buf, size_t len, int port);
+
+int transport_listen(int port);
+int transport_accept(int listen_fd);
+int transport_connect(const char* endpoint);
+
+ssize_t read_full(int fd, void* buf, size_t len);
+
+void registrations_init(struct Registrations* r, size_t msg_size);
+int registrations_accept(struct Registrations* r, int listen_fd);
+int registrations_watch(struct Registrations* r, fd_set* read_fds, int max_fd, struct timeval* timeout);
+int registrations_read(struct Registrations* r, fd_set* read_fds);
+int registrations_next(struct Registrations* r, void* msg);
+
+#endif
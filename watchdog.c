@@ -6,29 +6,31 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include "protocol.h"
+#include "topology.h"
+#include "handoff.h"
 
 #define WD_LOG_STR "[WATCHDOG]: %s\n"
 #define INFORM_STR "%s %d informed their pid %d\n"
+#define INFORM_CPU_STR "%s %d informed their pid %d, pinned to cpu %d\n"
 #define LOAD_BALANCER_SOCKET_PATH "/tmp/lb-wd"   // the socket path for the communication with the load balancer
 #define LOAD_BALANCER_AMOUNT 1
-#define REVERSE_PROXY_AMOUNT_PER_LOAD_BALANCER 2
-#define SERVER_AMOUNT_PER_REVERSE_PROXY 3
-#define REVERSE_PROXY_AMOUNT (LOAD_BALANCER_AMOUNT * REVERSE_PROXY_AMOUNT_PER_LOAD_BALANCER)
-#define SERVER_AMOUNT (REVERSE_PROXY_AMOUNT * SERVER_AMOUNT_PER_REVERSE_PROXY)
+#define REVERSE_PROXY_AMOUNT (LOAD_BALANCER_AMOUNT * rp_per_lb)
+#define SERVER_AMOUNT (REVERSE_PROXY_AMOUNT * sv_per_rp)
 
-enum ProcessType { LOAD_BALANCER, REVERSE_PROXY, SERVER };
-
-struct ProcessInform {
-    enum ProcessType type;
-    int p_idx;
-    pid_t p_id;
-};
+int rp_per_lb; // handed down to the load balancers in DS_RP_AMOUNT
+int sv_per_rp; // handed down to the reverse proxies in DS_SV_AMOUNT
 
 int lb_sockets[LOAD_BALANCER_AMOUNT] = {-1};
+int lb_retiring[LOAD_BALANCER_AMOUNT] = {-1}; // socket of a load balancer handing over to its successor
+pid_t lb_retiring_p_ids[LOAD_BALANCER_AMOUNT] = {0};
+volatile sig_atomic_t upgrade_requested = 0;
 
 pid_t lb_p_ids[LOAD_BALANCER_AMOUNT] = {0};
-pid_t rp_p_ids[REVERSE_PROXY_AMOUNT] = {0};
-pid_t sv_p_ids[SERVER_AMOUNT] = {0};
+pid_t rp_p_ids[LOAD_BALANCER_AMOUNT * MAX_RP] = {0};
+pid_t sv_p_ids[LOAD_BALANCER_AMOUNT * MAX_RP * MAX_SV] = {0};
 
 const char* process_to_string(enum ProcessType type) {
     switch (type)
@@ -75,9 +77,10 @@ void kill_processes() {
         if (rp_p_ids[rp_idx] != 0) kill_process(rp_p_ids[rp_idx]);
     }
 
-    // kill load balancers
+    // kill load balancers, also one that is in the middle of handing over
     for (int lb_idx = 0; lb_idx < LOAD_BALANCER_AMOUNT; lb_idx++) {
         if (lb_p_ids[lb_idx] != 0) kill_process(lb_p_ids[lb_idx]);
+        if (lb_retiring[lb_idx] != -1) kill_process(lb_retiring_p_ids[lb_idx]);
     }
 
     // cleanup
@@ -94,6 +97,136 @@ void handle_sigtstp(int sig) {
     _exit(0);
 }
 
+void handle_sighup(int sig) {
+    upgrade_requested = 1;
+}
+
+// start the load balancer binary again next to each running one and have the old one hand its sockets over
+void upgrade_load_balancers() {
+    for (int lb_id = 0; lb_id < LOAD_BALANCER_AMOUNT; lb_id++) {
+        if (lb_sockets[lb_id] == -1 || lb_retiring[lb_id] != -1) continue;
+
+        int sv[2]; // socket pair for the successor
+        int hs[2]; // socket pair the old load balancer hands over on
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            return;
+        }
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, hs) == -1) {
+            perror("socketpair");
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        }
+
+        pid_t lb_p_id = fork();
+        if (lb_p_id < 0) {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+            close(hs[0]);
+            close(hs[1]);
+            return;
+        } else if (lb_p_id == 0) {
+            // Child process: exec the (possibly new) load_balancer binary
+            close(sv[0]);
+            close(hs[0]);
+            // the old load balancer's exit must show up as a closed socket
+            close(lb_sockets[lb_id]);
+
+            char index_str[10], fd_str[10], handoff_str[10];
+            snprintf(index_str, sizeof(index_str), "%d", lb_id);
+            snprintf(fd_str, sizeof(fd_str), "%d", sv[1]);
+            snprintf(handoff_str, sizeof(handoff_str), "%d", hs[1]);
+
+            execl("./load_balancer", "load_balancer", index_str, fd_str, handoff_str, NULL);
+            perror("execl");
+            _exit(EXIT_FAILURE);
+        }
+
+        // Parent process: ask the old one to hand over, it gets its end of the handoff socket with the request
+        close(sv[1]);
+        close(hs[1]);
+        char cmd = HANDOFF_CMD;
+        int sent = send_with_fds(lb_sockets[lb_id], &cmd, 1, &hs[0], 1);
+        close(hs[0]);
+        if (sent < 0) {
+            perror("send handoff");
+            close(sv[0]);
+            kill_process(lb_p_id);
+            waitpid(lb_p_id, NULL, 0);
+            continue;
+        }
+
+        lb_retiring[lb_id] = lb_sockets[lb_id];
+        lb_retiring_p_ids[lb_id] = lb_p_ids[lb_id];
+        lb_sockets[lb_id] = sv[0];
+        lb_p_ids[lb_id] = lb_p_id;
+
+        char msg_buf[96];
+        snprintf(msg_buf, sizeof(msg_buf), "Load Balancer %d (pid %d) hands over to pid %d", 
+                 lb_id, lb_retiring_p_ids[lb_id], lb_p_id);
+        log_msg(msg_buf);
+    }
+}
+
+void handle_inform(const struct ProcessInform* inf) {
+    switch (inf->type)
+    {
+    case LOAD_BALANCER:
+        if (inf->p_idx >= 0 && inf->p_idx < LOAD_BALANCER_AMOUNT) lb_p_ids[inf->p_idx] = inf->p_id;
+        break;
+    case REVERSE_PROXY:
+        if (inf->p_idx >= 0 && inf->p_idx < REVERSE_PROXY_AMOUNT) rp_p_ids[inf->p_idx] = inf->p_id;
+        break;
+    case SERVER:
+        if (inf->p_idx >= 0 && inf->p_idx < SERVER_AMOUNT) sv_p_ids[inf->p_idx] = inf->p_id;
+        break;
+    default:
+        break;
+    }
+    char msg_buf[128];
+    if (inf->cpu >= 0) {
+        snprintf(msg_buf, sizeof(msg_buf), INFORM_CPU_STR, 
+                 process_to_string(inf->type), inf->p_idx, inf->p_id, inf->cpu);
+    } else {
+        snprintf(msg_buf, sizeof(msg_buf), INFORM_STR, process_to_string(inf->type), inf->p_idx, inf->p_id);
+    }
+    log_msg(msg_buf);
+}
+
+// a retiring load balancer closes its socket when it exits after the handoff
+void read_retiring(int lb_idx) {
+    struct ProcessInform inf;
+    ssize_t bytes_read = read(lb_retiring[lb_idx], &inf, sizeof(inf));
+    if (bytes_read == sizeof(inf)) {
+        handle_inform(&inf);
+    } else if (bytes_read == 0) {
+        char msg_buf[64];
+        snprintf(msg_buf, sizeof(msg_buf), "Load Balancer %d handed over and exited", lb_idx);
+        log_msg(msg_buf);
+        close(lb_retiring[lb_idx]);
+        lb_retiring[lb_idx] = -1;
+        waitpid(lb_retiring_p_ids[lb_idx], NULL, 0);
+    } else {
+        perror("read");
+    }
+}
+
+// the successor died before taking over, the old load balancer keeps serving
+void restore_retiring(int lb_idx) {
+    char msg_buf[96];
+    snprintf(msg_buf, sizeof(msg_buf), "Successor of Load Balancer %d failed, pid %d keeps serving", 
+             lb_idx, lb_retiring_p_ids[lb_idx]);
+    log_msg(msg_buf);
+
+    close(lb_sockets[lb_idx]);
+    waitpid(lb_p_ids[lb_idx], NULL, 0);
+    lb_sockets[lb_idx] = lb_retiring[lb_idx];
+    lb_p_ids[lb_idx] = lb_retiring_p_ids[lb_idx];
+    lb_retiring[lb_idx] = -1;
+}
+
 void start_load_balancers() {
     for (int lb_id = 0; lb_id < LOAD_BALANCER_AMOUNT; lb_id++) {
         int sv[2]; // socket pair
@@ -127,14 +260,65 @@ void start_load_balancers() {
     }
 }
 
-int main() {
+// size the tree, settle the cpus it runs on and pass both down to the children in the environment
+void configure(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:px:")) != -1) {
+        switch (opt)
+        {
+        case 'r':
+            setenv(RP_AMOUNT_ENV, optarg, 1);
+            break;
+        case 's':
+            setenv(SV_AMOUNT_ENV, optarg, 1);
+            break;
+        case 'p':
+            setenv(PIN_ENV, "1", 1);
+            break;
+        case 'x':
+            setenv(RESERVED_CPUS_ENV, optarg, 1);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r reverse_proxies|auto] [-s servers_per_proxy|auto] [-p] [-x reserved_cpus]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    char summary[512];
+    topology_export(summary, sizeof(summary));
+
+    // "auto" is resolved here once, the children get plain numbers
+    rp_per_lb = rp_amount();
+    sv_per_rp = sv_amount();
+    char amount[16];
+    snprintf(amount, sizeof(amount), "%d", rp_per_lb);
+    setenv(RP_AMOUNT_ENV, amount, 1);
+    snprintf(amount, sizeof(amount), "%d", sv_per_rp);
+    setenv(SV_AMOUNT_ENV, amount, 1);
+
+    const char* pin = getenv(PIN_ENV);
+    char msg_buf[640];
+    snprintf(msg_buf, sizeof(msg_buf), "%d reverse proxies with %d servers each, %s, %s", 
+             rp_per_lb, sv_per_rp, (pin != NULL && atoi(pin) != 0) ? "pinned" : "unpinned", summary);
+    log_msg(msg_buf);
+}
+
+int main(int argc, char* argv[]) {
     log_msg("Started");
+    configure(argc, argv);
 
     signal(SIGTSTP, handle_sigtstp);
+    // SIGHUP restarts the load balancers from the binary on disk without dropping traffic
+    signal(SIGHUP, handle_sighup);
 
     start_load_balancers();
 
     while (1) {
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            upgrade_load_balancers();
+        }
+
         fd_set readfds;
         int max_fd = -1;
         FD_ZERO(&readfds);
@@ -145,6 +329,10 @@ int main() {
                 FD_SET(lb_sockets[i], &readfds);
                 if (lb_sockets[i] > max_fd) max_fd = lb_sockets[i];
             }
+            if (lb_retiring[i] != -1) {
+                FD_SET(lb_retiring[i], &readfds);
+                if (lb_retiring[i] > max_fd) max_fd = lb_retiring[i];
+            }
         }
 
         // check if there are no active sockets
@@ -156,35 +344,24 @@ int main() {
         // Wait for any of the sockets to become ready
         int activity = select(max_fd + 1, &readfds, NULL, NULL, NULL);
         if (activity < 0) {
-            perror("select");
+            if (errno != EINTR) perror("select");
             continue;
         }
 
         // Check which socket has data
         for (int i = 0; i < LOAD_BALANCER_AMOUNT; ++i) {
+            if (lb_retiring[i] != -1 && FD_ISSET(lb_retiring[i], &readfds)) {
+                read_retiring(i);
+            }
             if (lb_sockets[i] == -1) continue;
 
             if (FD_ISSET(lb_sockets[i], &readfds)) {
                 struct ProcessInform inf;
                 ssize_t bytes_read = read(lb_sockets[i], &inf, sizeof(inf));
                 if (bytes_read == sizeof(inf)) {
-                    switch (inf.type)
-                    {
-                    case LOAD_BALANCER:
-                        if (inf.p_idx >= 0 && inf.p_idx < LOAD_BALANCER_AMOUNT) lb_p_ids[inf.p_idx] = inf.p_id;
-                        break;
-                    case REVERSE_PROXY:
-                        if (inf.p_idx >= 0 && inf.p_idx < REVERSE_PROXY_AMOUNT) rp_p_ids[inf.p_idx] = inf.p_id;
-                        break;
-                    case SERVER:
-                        if (inf.p_idx >= 0 && inf.p_idx < SERVER_AMOUNT) sv_p_ids[inf.p_idx] = inf.p_id;
-                        break;
-                    default:
-                        break;
-                    }
-                    char msg_buf[128];
-                    snprintf(msg_buf, sizeof(msg_buf), INFORM_STR, process_to_string(inf.type), inf.p_idx, inf.p_id);
-                    log_msg(msg_buf);
+                    handle_inform(&inf);
+                } else if (bytes_read == 0 && lb_retiring[i] != -1) {
+                    restore_retiring(i);
                 } else if (bytes_read == 0) {
                     char msg_buf[64];
                     snprintf(msg_buf, sizeof(msg_buf), "LB %d closed the socket\n", i);